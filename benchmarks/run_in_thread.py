@@ -0,0 +1,75 @@
+#!/usr/bin/env python
+"""
+Offload trivial calls to worker threads from greenlets, and wait for
+them with ``run_pending_switches()``.
+
+``run_in_thread()`` is compared with doing the same thing in Python
+with a ``concurrent.futures.ThreadPoolExecutor`` whose done callbacks
+use ``switch_threadsafe()``. Since the calls themselves do nothing,
+the time reported is the overhead of one round trip.
+"""
+
+import concurrent.futures
+import threading
+
+import pyperf
+import greenlet
+
+INNER_LOOPS = 1000
+
+
+def _noop():
+    pass
+
+
+def _run_greenlets(loops, offload):
+    wakeup = threading.Event()
+    greenlet.set_switch_wakeup(wakeup.set)
+    try:
+        def run():
+            for _ in range(INNER_LOOPS):
+                offload(_noop)
+
+        begin = pyperf.perf_counter()
+        for _ in range(loops):
+            glet = greenlet.greenlet(run)
+            glet.switch()
+            while not glet.dead:
+                wakeup.wait()
+                wakeup.clear()
+                greenlet.run_pending_switches()
+        end = pyperf.perf_counter()
+    finally:
+        greenlet.set_switch_wakeup(None)
+    return end - begin
+
+
+def bm_run_in_thread(loops):
+    return _run_greenlets(loops, greenlet.run_in_thread)
+
+
+def bm_executor(loops):
+    with concurrent.futures.ThreadPoolExecutor() as executor:
+        def offload(func):
+            current = greenlet.getcurrent()
+            future = executor.submit(func)
+            future.add_done_callback(
+                lambda f: current.switch_threadsafe(f.result()))
+            return current.parent.switch()
+        return _run_greenlets(loops, offload)
+
+
+if __name__ == '__main__':
+    runner = pyperf.Runner()
+
+    runner.bench_time_func(
+        'run_in_thread() round trip',
+        bm_run_in_thread,
+        inner_loops=INNER_LOOPS
+    )
+
+    runner.bench_time_func(
+        'ThreadPoolExecutor round trip',
+        bm_executor,
+        inner_loops=INNER_LOOPS
+    )
@@ -0,0 +1,67 @@
+#!/usr/bin/env python
+"""
+Switch between greenlets in several threads at once.
+
+Every thread does the same amount of switching, and the time reported
+is the wall-clock time for all of them to finish, divided by the
+number of switches *one* thread did. If threads could switch in
+parallel, the time would stay flat as threads are added; with the GIL,
+it grows about linearly with the number of threads.
+"""
+
+import threading
+
+import pyperf
+import greenlet
+
+INNER_LOOPS = 10000
+THREAD_COUNTS = (1, 2, 4, 8)
+
+
+def _ping_pong(loops, ready, go):
+    def run():
+        switch = greenlet.getcurrent().parent.switch
+        while True:
+            switch()
+
+    glet = greenlet.greenlet(run)
+    switch = glet.switch
+    switch()
+    ready.wait()
+    go.wait()
+    for _ in range(loops):
+        for _ in range(INNER_LOOPS):
+            switch()
+    glet.throw()
+
+
+def bm_switch_threads(loops, thread_count):
+    # Everybody, including us, waits for the threads to be set up,
+    # and then for the signal to go.
+    ready = threading.Barrier(thread_count + 1)
+    go = threading.Barrier(thread_count + 1)
+    threads = [
+        threading.Thread(target=_ping_pong, args=(loops, ready, go))
+        for _ in range(thread_count)
+    ]
+    for t in threads:
+        t.start()
+    ready.wait()
+    begin = pyperf.perf_counter()
+    go.wait()
+    for t in threads:
+        t.join()
+    end = pyperf.perf_counter()
+    return end - begin
+
+
+if __name__ == '__main__':
+    runner = pyperf.Runner()
+
+    for count in THREAD_COUNTS:
+        runner.bench_time_func(
+            'switch in %d thread(s)' % (count,),
+            bm_switch_threads,
+            count,
+            inner_loops=INNER_LOOPS
+        )
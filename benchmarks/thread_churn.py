@@ -0,0 +1,65 @@
+#!/usr/bin/env python
+"""
+Start threads that use greenlets and let them exit, in a process with
+a large number of live objects.
+
+Each thread leaves a greenlet suspended and hands it to the main
+thread, which drops it while the thread is still running; that's how
+greenlets get killed across threads when a thread pool's work is
+cancelled. The thread's greenlet state is torn down in the main
+thread, and the time reported includes that. Any work proportional to
+the size of the heap done during teardown shows up here as the heap
+grows.
+"""
+
+import threading
+
+import pyperf
+import greenlet
+
+HEAP_SIZES = (0, 100000, 1000000)
+
+_heap = []
+
+
+def _worker(handoff, handed_off, dropped):
+    glet = greenlet.greenlet(lambda: greenlet.getcurrent().parent.switch())
+    glet.switch()
+    handoff.append(glet)
+    del glet
+    handed_off.set()
+    dropped.wait()
+
+
+def bm_thread_churn(loops, heap_size):
+    _heap[:] = [[] for _ in range(heap_size)]
+    greenlet.getcurrent()
+    begin = pyperf.perf_counter()
+    for _ in range(loops):
+        handoff = []
+        handed_off = threading.Event()
+        dropped = threading.Event()
+        t = threading.Thread(target=_worker,
+                             args=(handoff, handed_off, dropped))
+        t.start()
+        handed_off.wait()
+        del handoff[:]
+        dropped.set()
+        t.join()
+        # Give the pending call that destroys the thread's state a
+        # chance to run.
+        greenlet.getcurrent()
+    end = pyperf.perf_counter()
+    del _heap[:]
+    return end - begin
+
+
+if __name__ == '__main__':
+    runner = pyperf.Runner()
+
+    for size in HEAP_SIZES:
+        runner.bench_time_func(
+            'thread churn with %d extra objects' % (size,),
+            bm_thread_churn,
+            size,
+        )
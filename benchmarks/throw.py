@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+"""
+Benchmarks for delivering exceptions into greenlets with ``throw()``:
+the timeout pattern (the target catches the exception and switches
+back), killing greenlets with ``GreenletExit``, and an exception that
+propagates out of the target back to the thrower.
+"""
+
+import pyperf
+import greenlet
+
+INNER_LOOPS = 1000
+
+class Timeout(Exception):
+    pass
+
+
+def bm_throw_caught(loops):
+    def run():
+        parent = greenlet.getcurrent().parent
+        while True:
+            try:
+                parent.switch()
+            except Timeout:
+                pass
+
+    glet = greenlet.greenlet(run)
+    glet.switch()
+    throw = glet.throw
+    begin = pyperf.perf_counter()
+    for _ in range(loops):
+        for _ in range(INNER_LOOPS):
+            throw(Timeout)
+    end = pyperf.perf_counter()
+    glet.throw()
+    return end - begin
+
+
+def _suspended_greenlets(count):
+    def run():
+        greenlet.getcurrent().parent.switch()
+
+    glets = [greenlet.greenlet(run) for _ in range(count)]
+    for glet in glets:
+        glet.switch()
+    return glets
+
+
+def bm_kill(loops):
+    elapsed = 0
+    for _ in range(loops):
+        glets = _suspended_greenlets(INNER_LOOPS)
+        begin = pyperf.perf_counter()
+        for glet in glets:
+            glet.throw()
+        elapsed += pyperf.perf_counter() - begin
+    return elapsed
+
+
+def bm_throw_uncaught(loops):
+    elapsed = 0
+    for _ in range(loops):
+        glets = _suspended_greenlets(INNER_LOOPS)
+        begin = pyperf.perf_counter()
+        for glet in glets:
+            try:
+                glet.throw(Timeout)
+            except Timeout:
+                pass
+        elapsed += pyperf.perf_counter() - begin
+    return elapsed
+
+
+if __name__ == '__main__':
+    runner = pyperf.Runner()
+
+    runner.bench_time_func(
+        'throw() into a greenlet that catches it',
+        bm_throw_caught,
+        inner_loops=INNER_LOOPS
+    )
+
+    runner.bench_time_func(
+        'kill a suspended greenlet with throw()',
+        bm_kill,
+        inner_loops=INNER_LOOPS
+    )
+
+    runner.bench_time_func(
+        'throw() an exception that propagates back',
+        bm_throw_uncaught,
+        inner_loops=INNER_LOOPS
+    )
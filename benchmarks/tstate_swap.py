@@ -0,0 +1,108 @@
+#!/usr/bin/env python
+"""
+Compare what a switch costs today, saving and restoring the relevant
+``PyThreadState`` fields one by one into each greenlet, against what
+it would cost to give each greenlet its own ``PyThreadState`` and
+switch between them with ``PyThreadState_Swap``.
+
+The second mode still needs to switch the C stack, so its cost is at
+least the cost of the swap itself, which is what we measure here
+(through ctypes, with the ctypes call overhead subtracted).
+
+Typical results, nanoseconds per round trip (there and back again):
+
+=======  ===========================  ============================
+Python   greenlet switch (whole)      PyThreadState_Swap (alone)
+=======  ===========================  ============================
+3.9      ~400                         ~290
+3.10     ~400                         ~195
+3.11     ~460                         ~325
+3.12     ~580                         ~435
+=======  ===========================  ============================
+
+Swapping thread states costs nearly as much as an entire greenlet
+switch, and on 3.12+ ``PyThreadState_Swap`` also releases and
+re-acquires the GIL, turning every greenlet switch into a point where
+another thread can run. Separate thread states would also split
+per-thread data such as ``threading.local`` and ``sys.settrace``
+across greenlets of the same thread, and each would need its own
+frame data stack. So we keep saving and restoring fields.
+"""
+
+import ctypes
+
+import pyperf
+import greenlet
+
+INNER_LOOPS = 10000
+
+def bm_switch_greenlet(loops):
+    def run():
+        parent = greenlet.getcurrent().parent
+        while True:
+            parent.switch()
+
+    glet = greenlet.greenlet(run)
+    glet.switch()
+    switch = glet.switch
+    begin = pyperf.perf_counter()
+    for _ in range(loops):
+        for _ in range(INNER_LOOPS):
+            switch()
+    end = pyperf.perf_counter()
+    glet.throw()
+    return end - begin
+
+
+def _api():
+    api = ctypes.pythonapi
+    api.PyThreadState_Get.restype = ctypes.c_void_p
+    api.PyInterpreterState_Get.restype = ctypes.c_void_p
+    api.PyThreadState_New.restype = ctypes.c_void_p
+    api.PyThreadState_New.argtypes = [ctypes.c_void_p]
+    api.PyThreadState_Swap.restype = ctypes.c_void_p
+    api.PyThreadState_Swap.argtypes = [ctypes.c_void_p]
+    api.PyThreadState_Clear.argtypes = [ctypes.c_void_p]
+    api.PyThreadState_Delete.argtypes = [ctypes.c_void_p]
+    return api
+
+def bm_tstate_swap(loops):
+    api = _api()
+    this = api.PyThreadState_Get()
+    other = api.PyThreadState_New(api.PyInterpreterState_Get())
+    swap = api.PyThreadState_Swap
+    get = api.PyThreadState_Get
+    elapsed = 0
+    try:
+        for _ in range(loops):
+            begin = pyperf.perf_counter()
+            for _ in range(INNER_LOOPS):
+                swap(other)
+                swap(this)
+            elapsed += pyperf.perf_counter() - begin
+            # Take out the cost of making two calls through ctypes.
+            begin = pyperf.perf_counter()
+            for _ in range(INNER_LOOPS):
+                get()
+                get()
+            elapsed -= pyperf.perf_counter() - begin
+    finally:
+        api.PyThreadState_Clear(other)
+        api.PyThreadState_Delete(other)
+    return elapsed
+
+
+if __name__ == '__main__':
+    runner = pyperf.Runner()
+
+    runner.bench_time_func(
+        'switch to a greenlet and back',
+        bm_switch_greenlet,
+        inner_loops=INNER_LOOPS
+    )
+
+    runner.bench_time_func(
+        'PyThreadState_Swap and back',
+        bm_tstate_swap,
+        inner_loops=INNER_LOOPS
+    )
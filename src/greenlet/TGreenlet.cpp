@@ -10,6 +10,12 @@
  *   clang-tidy src/greenlet/greenlet.c -fix -checks="readability-braces-around-statements"
 */
 
+#include <ctime>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "greenlet_clock.hpp"
 #include "greenlet_internal.hpp"
 #include "greenlet_greenlet.hpp"
 #include "greenlet_thread_state.hpp"
@@ -19,6 +25,16 @@
 
 namespace greenlet {
 
+uint64_t Greenlet::lineage_epoch = 1;
+
+void
+Greenlet::lineage_changed() noexcept
+{
+    if (this->_may_have_children) {
+        ++lineage_epoch;
+    }
+}
+
 Greenlet::Greenlet(PyGreenlet* p)
 {
     p ->pimpl = this;
@@ -26,6 +42,7 @@ Greenlet::Greenlet(PyGreenlet* p)
 
 Greenlet::~Greenlet()
 {
+    this->forget_live();
     // XXX: Can't do this. tp_clear is a virtual function, and by the
     // time we're here, we've sliced off our child classes.
     //this->tp_clear();
@@ -67,14 +84,50 @@ Greenlet::throw_GreenletExit_during_dealloc(const ThreadState& UNUSED(current_th
     return this->g_switch();
 }
 
+uint64_t
+Accounting::monotonic_ns() noexcept
+{
+    return steady_clock_ns();
+}
+
+uint64_t
+Accounting::thread_cpu_ns() noexcept
+{
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    // In units of 100ns.
+    return ((static_cast<uint64_t>(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime)
+            + (static_cast<uint64_t>(user.dwHighDateTime) << 32 | user.dwLowDateTime)) * 100;
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) {
+        return 0;
+    }
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
 inline void
 Greenlet::slp_restore_state() noexcept
 {
 #ifdef SLP_BEFORE_RESTORE_STATE
     SLP_BEFORE_RESTORE_STATE();
 #endif
+    ThreadState* const thread_state = this->thread_state();
+    SwitchTiming* const timing = thread_state->borrow_switch_timing();
+    const uint64_t started = timing ? SwitchTiming::now() : 0;
+    switching_stack_bytes += this->stack_state.stack_saved();
     this->stack_state.copy_heap_to_stack(
-           this->thread_state()->borrow_current()->stack_state);
+           thread_state->borrow_current()->stack_state,
+           thread_state->stats());
+    if (timing) {
+        timing->record(SwitchTiming::RESTORE, started);
+    }
 }
 
 
@@ -88,8 +141,21 @@ Greenlet::slp_save_state(char *const stackref) noexcept
 #ifdef SLP_BEFORE_SAVE_STATE
     SLP_BEFORE_SAVE_STATE();
 #endif
-    return this->stack_state.copy_stack_to_heap(stackref,
-                                                this->thread_state()->borrow_current()->stack_state);
+    ThreadState* const thread_state = this->thread_state();
+    SwitchTiming* const timing = thread_state->borrow_switch_timing();
+    const uint64_t started = timing ? SwitchTiming::now() : 0;
+    const intptr_t saved = this->stack_state.copy_stack_to_heap(
+        stackref,
+        thread_state->borrow_current()->stack_state,
+        thread_state->stats());
+    if (saved < 0) {
+        return -1;
+    }
+    if (timing) {
+        timing->record(SwitchTiming::SAVE, started);
+    }
+    switching_stack_bytes += saved;
+    return 0;
 }
 
 /**
@@ -135,10 +201,7 @@ Greenlet::g_switchstack_success() noexcept
 
     // The thread state hasn't been changed yet.
     ThreadState* thread_state = this->thread_state();
-    OwnedGreenlet result(thread_state->get_current());
-    thread_state->set_current(this->self());
-    //assert(thread_state->borrow_current().borrow() == this->_self);
-    return result;
+    return thread_state->exchange_current(this->self());
 }
 
 Greenlet::switchstack_result_t
@@ -154,21 +217,34 @@ Greenlet::g_switchstack(void)
     // gevent it's possible without realizing it)
     assert(this->args() || PyErr_Occurred());
     { /* save state */
-        if (this->thread_state()->is_current(this->self())) {
+        ThreadState* const thread_state = this->thread_state();
+        if (thread_state->is_current(this->self())) {
             // Hmm, nothing to do.
             // TODO: Does this bypass trace events that are
             // important?
             return switchstack_result_t(0,
-                                        this, this->thread_state()->borrow_current());
+                                        this, thread_state->borrow_current());
         }
-        BorrowedGreenlet current = this->thread_state()->borrow_current();
+        BorrowedGreenlet current = thread_state->borrow_current();
         PyThreadState* tstate = PyThreadState_GET();
+        SwitchTiming* const timing = thread_state->borrow_switch_timing();
+        uint64_t started = 0;
+        if (timing) {
+            started = timing->switch_started = SwitchTiming::now();
+        }
 
         current->python_state << tstate;
         current->exception_state << tstate;
         this->python_state.will_switch_from(tstate);
+        if (timing) {
+            started = timing->record(SwitchTiming::CAPTURE, started);
+        }
         switching_thread_state = this;
-        current->expose_frames();
+        switching_stack_bytes = 0;
+        thread_state->stats().frames_exposed += current->expose_frames();
+        if (timing) {
+            timing->record(SwitchTiming::EXPOSE, started);
+        }
     }
     assert(this->args() || PyErr_Occurred());
     // If this is the first switch into a greenlet, this will
@@ -209,7 +285,47 @@ Greenlet::g_switchstack(void)
 
     OwnedGreenlet origin = greenlet_that_switched_in->g_switchstack_success();
     assert(greenlet_that_switched_in->args() || PyErr_Occurred());
-    return switchstack_result_t(err, greenlet_that_switched_in, origin);
+    ThreadState* const thread_state = greenlet_that_switched_in->thread_state();
+    {
+        SwitchStats& stats = thread_state->stats();
+        stats.switches++;
+        if (err == 1) {
+            stats.initial_stubs++;
+        }
+        if (!origin->active()) {
+            stats.finished++;
+        }
+        else if (!greenlet_that_switched_in->args()) {
+            stats.throws++;
+        }
+    }
+    if (StallWatch* const watch = thread_state->borrow_stall_watch()) {
+        watch->current.store(greenlet_that_switched_in->self().borrow(), std::memory_order_relaxed);
+        watch->switches.fetch_add(1, std::memory_order_release);
+    }
+    if (thread_state->accounting()) {
+        const uint64_t now = Accounting::monotonic_ns();
+        const uint64_t cpu_now = thread_state->accounting_cpu_now();
+        origin->accounting().stop(now, cpu_now);
+        Accounting& accounting = greenlet_that_switched_in->accounting();
+        accounting.switches++;
+        accounting.start(now, cpu_now);
+        accounting.switched_in = now;
+    }
+    if (SwitchLog* const log = thread_state->borrow_switch_log()) {
+        // Same events as the native trace function; see
+        // g_switch_finish() and inner_bootstrap().
+        const bool thrown = !greenlet_that_switched_in->args();
+        log->record(err == 1
+                    ? (thrown ? PyGreenlet_TRACE_THROW : PyGreenlet_TRACE_START)
+                    : !origin->active()
+                    ? PyGreenlet_TRACE_FINISH
+                    : thrown ? PyGreenlet_TRACE_THROW : PyGreenlet_TRACE_SWITCH,
+                    origin.borrow(),
+                    greenlet_that_switched_in->self().borrow(),
+                    switching_stack_bytes);
+    }
+    return switchstack_result_t(err, greenlet_that_switched_in, std::move(origin));
 }
 
 
@@ -359,21 +475,21 @@ OwnedObject& operator<<=(OwnedObject& lhs, greenlet::SwitchingArgs& rhs) noexcep
     // result in switching back to us, we need to get the
     // arguments locally on the stack.
     assert(rhs);
-    OwnedObject args = rhs.args();
-    OwnedObject kwargs = rhs.kwargs();
-    rhs.CLEAR();
+    OwnedObject args;
+    OwnedObject kwargs;
+    rhs.move_to(args, kwargs);
     // We shouldn't be called twice for the same switch.
     assert(args || kwargs);
     assert(!rhs);
 
     if (!kwargs) {
-        lhs = args;
+        lhs = std::move(args);
     }
     else if (!PyDict_Size(kwargs.borrow())) {
-        lhs = args;
+        lhs = std::move(args);
     }
     else if (!PySequence_Length(args.borrow())) {
-        lhs = kwargs;
+        lhs = std::move(kwargs);
     }
     else {
         // PyTuple_Pack allocates memory, may GC, may run arbitrary
@@ -430,37 +546,58 @@ Greenlet::g_switch_finish(const switchstack_result_t& err)
         assert(PyErr_Occurred());
     }
     assert(!this->args());
-    try {
-        // Our only caller handles the bad error case
-        assert(err.status >= 0);
-        assert(state.borrow_current() == this->self());
-        if (OwnedObject tracefunc = state.get_tracefunc()) {
-            assert(result || PyErr_Occurred());
+    // Our only caller handles the bad error case
+    assert(err.status >= 0);
+    assert(state.borrow_current() == this->self());
+    const uint64_t trace_started = state.borrow_switch_timing()
+        && (state.has_native_trace() || state.has_tracefunc())
+        ? SwitchTiming::now() : 0;
+    if (state.has_native_trace()) {
+        // The origin is only dead here if it just finished running.
+        state.call_native_trace(!err.origin_greenlet->active()
+                                ? PyGreenlet_TRACE_FINISH
+                                : result ? PyGreenlet_TRACE_SWITCH : PyGreenlet_TRACE_THROW,
+                                err.origin_greenlet.borrow(),
+                                this->self().borrow());
+    }
+    if (OwnedObject tracefunc = state.get_tracefunc()) {
+        assert(result || PyErr_Occurred());
+        try {
             g_calltrace(tracefunc,
                         result ? mod_globs->event_switch : mod_globs->event_throw,
                         err.origin_greenlet,
                         this->self());
         }
-        // The above could have invoked arbitrary Python code, but
-        // it couldn't switch back to this object and *also*
-        // throw an exception, so the args won't have changed.
-
-        if (PyErr_Occurred()) {
-            // We get here if we fell of the end of the run() function
-            // raising an exception. The switch itself was
-            // successful, but the function raised.
-            // valgrind reports that memory allocated here can still
-            // be reached after a test run.
-            throw PyErrOccurred::from_current();
+        catch (const PyErrOccurred&) {
+            /* Turn trace errors into switch throws */
+            this->release_args();
+            if (SwitchTiming* const timing = state.borrow_switch_timing()) {
+                timing->finish_switch(trace_started);
+            }
+            return OwnedObject();
         }
-        return result;
     }
-    catch (const PyErrOccurred&) {
-        /* Turn switch errors into switch throws */
-        /* Turn trace errors into switch throws */
+    // The trace functions could have stopped the timing.
+    if (SwitchTiming* const timing = state.borrow_switch_timing()) {
+        timing->finish_switch(trace_started);
+    }
+    // Now that this switch has been reported and timed, do
+    // maintenance that can run arbitrary code and even switch;
+    // switches it makes are reported after this one.
+    ThreadState_Maintain(state);
+    // The above could have invoked arbitrary Python code, but
+    // it couldn't switch back to this object and *also*
+    // throw an exception, so the args won't have changed.
+
+    if (PyErr_Occurred()) {
+        // We get here if we fell of the end of the run() function
+        // raising an exception, or were thrown into. The switch
+        // itself was successful. See g_switch() for why this isn't
+        // a C++ exception.
         this->release_args();
-        throw;
+        return OwnedObject();
     }
+    return result;
 }
 
 void
@@ -507,7 +644,9 @@ Greenlet::deactivate_and_free()
     if (!this->active()) {
         return;
     }
-    // Throw away any saved stack.
+    // Throw away any saved stack. This makes us look unstarted.
+    this->lineage_changed();
+    this->forget_live();
     this->stack_state = StackState();
     assert(!this->stack_state.active());
     // Throw away any Python references.
@@ -548,7 +687,9 @@ Greenlet::deallocing_greenlet_in_thread(const ThreadState* current_thread_state)
 
         // We don't care about the return value, only whether an
         // exception happened.
-        this->throw_GreenletExit_during_dealloc(*current_thread_state);
+        if (!this->throw_GreenletExit_during_dealloc(*current_thread_state)) {
+            throw PyErrOccurred::from_current();
+        }
         return;
     }
 
@@ -607,108 +748,14 @@ bool Greenlet::is_currently_running_in_some_thread() const
     return this->stack_state.active() && !this->python_state.top_frame();
 }
 
-#if GREENLET_PY312
-void GREENLET_NOINLINE(Greenlet::expose_frames)()
+unsigned int Greenlet::expose_frames()
 {
-    if (!this->python_state.top_frame()) {
-        return;
-    }
-
-    _PyInterpreterFrame* last_complete_iframe = nullptr;
-    _PyInterpreterFrame* iframe = this->python_state.top_frame()->f_frame;
-    while (iframe) {
-        // We must make a copy before looking at the iframe contents,
-        // since iframe might point to a portion of the greenlet's C stack
-        // that was spilled when switching greenlets.
-        _PyInterpreterFrame iframe_copy;
-        this->stack_state.copy_from_stack(&iframe_copy, iframe, sizeof(*iframe));
-        if (!_PyFrame_IsIncomplete(&iframe_copy)) {
-            // If the iframe were OWNED_BY_CSTACK then it would always be
-            // incomplete. Since it's not incomplete, it's not on the C stack
-            // and we can access it through the original `iframe` pointer
-            // directly.  This is important since GetFrameObject might
-            // lazily _create_ the frame object and we don't want the
-            // interpreter to lose track of it.
-            assert(iframe_copy.owner != FRAME_OWNED_BY_CSTACK);
-
-            // We really want to just write:
-            //     PyFrameObject* frame = _PyFrame_GetFrameObject(iframe);
-            // but _PyFrame_GetFrameObject calls _PyFrame_MakeAndSetFrameObject
-            // which is not a visible symbol in libpython. The easiest
-            // way to get a public function to call it is using
-            // PyFrame_GetBack, which is defined as follows:
-            //     assert(frame != NULL);
-            //     assert(!_PyFrame_IsIncomplete(frame->f_frame));
-            //     PyFrameObject *back = frame->f_back;
-            //     if (back == NULL) {
-            //         _PyInterpreterFrame *prev = frame->f_frame->previous;
-            //         prev = _PyFrame_GetFirstComplete(prev);
-            //         if (prev) {
-            //             back = _PyFrame_GetFrameObject(prev);
-            //         }
-            //     }
-            //     return (PyFrameObject*)Py_XNewRef(back);
-            if (!iframe->frame_obj) {
-                PyFrameObject dummy_frame;
-                _PyInterpreterFrame dummy_iframe;
-                dummy_frame.f_back = nullptr;
-                dummy_frame.f_frame = &dummy_iframe;
-                // force the iframe to be considered complete without
-                // needing to check its code object:
-                dummy_iframe.owner = FRAME_OWNED_BY_GENERATOR;
-                dummy_iframe.previous = iframe;
-                assert(!_PyFrame_IsIncomplete(&dummy_iframe));
-                // Drop the returned reference immediately; the iframe
-                // continues to hold a strong reference
-                Py_XDECREF(PyFrame_GetBack(&dummy_frame));
-                assert(iframe->frame_obj);
-            }
-
-            // This is a complete frame, so make the last one of those we saw
-            // point at it, bypassing any incomplete frames (which may have
-            // been on the C stack) in between the two. We're overwriting
-            // last_complete_iframe->previous and need that to be reversible,
-            // so we store the original previous ptr in the frame object
-            // (which we must have created on a previous iteration through
-            // this loop). The frame object has a bunch of storage that is
-            // only used when its iframe is OWNED_BY_FRAME_OBJECT, which only
-            // occurs when the frame object outlives the frame's execution,
-            // which can't have happened yet because the frame is currently
-            // executing as far as the interpreter is concerned. So, we can
-            // reuse it for our own purposes.
-            assert(iframe->owner == FRAME_OWNED_BY_THREAD
-                   || iframe->owner == FRAME_OWNED_BY_GENERATOR);
-            if (last_complete_iframe) {
-                assert(last_complete_iframe->frame_obj);
-                memcpy(&last_complete_iframe->frame_obj->_f_frame_data[0],
-                       &last_complete_iframe->previous, sizeof(void *));
-                last_complete_iframe->previous = iframe;
-            }
-            last_complete_iframe = iframe;
-        }
-        // Frames that are OWNED_BY_FRAME_OBJECT are linked via the
-        // frame's f_back while all others are linked via the iframe's
-        // previous ptr. Since all the frames we traverse are running
-        // as far as the interpreter is concerned, we don't have to
-        // worry about the OWNED_BY_FRAME_OBJECT case.
-        iframe = iframe_copy.previous;
-    }
-
-    // Give the outermost complete iframe a null previous pointer to
-    // account for any potential incomplete/C-stack iframes between it
-    // and the actual top-of-stack
-    if (last_complete_iframe) {
-        assert(last_complete_iframe->frame_obj);
-        memcpy(&last_complete_iframe->frame_obj->_f_frame_data[0],
-               &last_complete_iframe->previous, sizeof(void *));
-        last_complete_iframe->previous = nullptr;
-    }
+    return this->python_state.expose_frames(this->stack_state);
 }
-#else
-void Greenlet::expose_frames()
-{
 
+void Greenlet::collect_frames(std::vector<PythonState::CodeLine>& frames) const
+{
+    this->python_state.collect_frames(this->stack_state, frames);
 }
-#endif
 
 }; // namespace greenlet
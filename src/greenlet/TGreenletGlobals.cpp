@@ -12,13 +12,69 @@
 #ifndef T_GREENLET_GLOBALS
 #define T_GREENLET_GLOBALS
 
+#include <algorithm>
+
 #include "greenlet_refs.hpp"
 #include "greenlet_exceptions.hpp"
 #include "greenlet_thread_support.hpp"
 #include "greenlet_thread_state.hpp"
+#include "TThreadPool.cpp"
+#include "TWatchdog.cpp"
 
 namespace greenlet {
 
+// Limits on, and statistics about, destroying the thread states of
+// threads that have exited. Except where noted, protected by
+// GreenletGlobals::thread_states_to_destroy_lock.
+struct ThreadStateCleanup
+{
+    typedef std::chrono::steady_clock clock;
+    typedef std::chrono::nanoseconds duration;
+
+    // A pass stops after destroying this many thread states, or
+    // after running this long, whichever comes first; it always
+    // destroys at least one. Zero means no limit.
+    size_t max_per_pass;
+    duration max_time_per_pass;
+
+    // Whether a pending call to run a pass has been scheduled.
+    bool pass_scheduled;
+    // Whether a pass stopped early with thread states left over.
+    // Read without the lock.
+    std::atomic<bool> left_over;
+
+    size_t max_queued;
+    size_t destroyed;
+    size_t passes;
+    size_t max_destroyed_per_pass;
+    duration total_time;
+    duration max_pass_time;
+    // From being queued to being destroyed.
+    duration total_latency;
+    duration max_latency;
+
+    ThreadStateCleanup()
+        : max_per_pass(0),
+          max_time_per_pass(0),
+          pass_scheduled(false),
+          left_over(false),
+          max_queued(0),
+          destroyed(0),
+          passes(0),
+          max_destroyed_per_pass(0),
+          total_time(0),
+          max_pass_time(0),
+          total_latency(0),
+          max_latency(0)
+    {}
+
+    bool budget_exhausted(size_t destroyed_this_pass, duration elapsed) const
+    {
+        return (this->max_per_pass && destroyed_this_pass >= this->max_per_pass)
+            || (this->max_time_per_pass.count() && elapsed >= this->max_time_per_pass);
+    }
+};
+
 // This encapsulates what were previously module global "constants"
 // established at init time.
 // This is a step towards Python3 style module state that allows
@@ -42,6 +98,11 @@ public:
     const greenlet::refs::ImmortalString str_run;
     Mutex* const thread_states_to_destroy_lock;
     greenlet::cleanup_queue_t thread_states_to_destroy;
+    greenlet::ThreadStateCleanup thread_state_cleanup;
+    // For run_in_thread(). Its workers refer to it forever.
+    greenlet::ThreadPool* const thread_pool;
+    // For start_watchdog(); its thread also refers to it forever.
+    greenlet::Watchdog* const watchdog;
 
     GreenletGlobals() :
         event_switch("switch"),
@@ -51,7 +112,9 @@ public:
         empty_tuple(Require(PyTuple_New(0))),
         empty_dict(Require(PyDict_New())),
         str_run("run"),
-        thread_states_to_destroy_lock(new Mutex())
+        thread_states_to_destroy_lock(new Mutex()),
+        thread_pool(new ThreadPool()),
+        watchdog(new Watchdog())
     {}
 
     ~GreenletGlobals()
@@ -75,16 +138,24 @@ public:
         //
         // Do that for callers.
         greenlet::cleanup_queue_t& q = const_cast<greenlet::cleanup_queue_t&>(this->thread_states_to_destroy);
-        q.push_back(ts);
+        q.push_back(greenlet::cleanup_queue_item_t(ts, ThreadStateCleanup::clock::now()));
+        ThreadStateCleanup& cleanup = this->cleanup();
+        cleanup.max_queued = std::max(cleanup.max_queued, q.size());
     }
 
-    ThreadState* take_next_to_destroy() const
+    // Oldest first.
+    greenlet::cleanup_queue_item_t take_next_to_destroy() const
     {
         greenlet::cleanup_queue_t& q = const_cast<greenlet::cleanup_queue_t&>(this->thread_states_to_destroy);
-        ThreadState* result = q.back();
-        q.pop_back();
+        greenlet::cleanup_queue_item_t result = q.front();
+        q.pop_front();
         return result;
     }
+
+    ThreadStateCleanup& cleanup() const
+    {
+        return const_cast<ThreadStateCleanup&>(this->thread_state_cleanup);
+    }
 };
 
 }; // namespace greenlet
@@ -64,7 +64,7 @@ MainGreenlet::thread_state(ThreadState* t) noexcept
 BorrowedGreenlet
 MainGreenlet::self() const noexcept
 {
-    return BorrowedGreenlet(this->_self.borrow());
+    return BorrowedGreenlet::trusted(this->_self.borrow());
 }
 
 
@@ -80,6 +80,12 @@ MainGreenlet::find_main_greenlet_in_lineage() const
     return BorrowedMainGreenlet(this->_self);
 }
 
+Py_ssize_t
+MainGreenlet::lineage_depth() const
+{
+    return 0;
+}
+
 bool
 MainGreenlet::was_running_in_dead_thread() const noexcept
 {
@@ -25,6 +25,12 @@ PythonState::PythonState()
     ,datastack_top(nullptr)
     ,datastack_limit(nullptr)
 #endif
+#if GREENLET_PY312
+    ,exposed_boundaries(nullptr)
+    ,watermark_iframe(nullptr)
+    ,watermark_frame_obj(nullptr)
+    ,watermark_boundaries(nullptr)
+#endif
 {
 #if GREENLET_USE_CFRAME
     /*
@@ -156,27 +162,288 @@ void PythonState::operator<<(const PyThreadState *const tstate) noexcept
 }
 
 #if GREENLET_PY312
-void GREENLET_NOINLINE(PythonState::unexpose_frames)()
+// While a frame is executing, the storage at the start of its frame
+// object's ``_f_frame_data`` is unused (it only holds data once the
+// frame object outlives the execution of the frame, i.e., is
+// OWNED_BY_FRAME_OBJECT; that copy overwrites whatever we left).
+// We borrow some of it for each frame we rewrite while exposing.
+enum {
+    // The real ``previous`` pointer, restored when we resume.
+    EXPOSED_ORIGINAL_PREVIOUS = 0,
+    // The next (outer) frame in the list of rewritten frames.
+    EXPOSED_NEXT_BOUNDARY = 1,
+    // What we rewrote ``previous`` to, so we can do it again.
+    EXPOSED_PREVIOUS = 2,
+};
+static_assert(offsetof(_PyInterpreterFrame, localsplus) >= 3 * sizeof(void*),
+              "Frame objects always have room for a frame header");
+
+static inline _PyInterpreterFrame*
+exposed_slot(const PyFrameObject* frame, int slot) noexcept
+{
+    _PyInterpreterFrame* result;
+    memcpy(&result,
+           reinterpret_cast<const char*>(frame->_f_frame_data) + slot * sizeof(void*),
+           sizeof(void*));
+    return result;
+}
+
+static inline void
+set_exposed_slot(PyFrameObject* frame, int slot, _PyInterpreterFrame* value) noexcept
+{
+    memcpy(reinterpret_cast<char*>(frame->_f_frame_data) + slot * sizeof(void*),
+           &value,
+           sizeof(void*));
+}
+
+// Return the frame object for a complete *iframe*, creating it if needed.
+static PyFrameObject*
+frame_object_for(_PyInterpreterFrame* iframe)
+{
+    assert(!_PyFrame_IsIncomplete(iframe));
+    // We really want to just write:
+    //     PyFrameObject* frame = _PyFrame_GetFrameObject(iframe);
+    // but _PyFrame_GetFrameObject calls _PyFrame_MakeAndSetFrameObject
+    // which is not a visible symbol in libpython. The easiest
+    // way to get a public function to call it is using
+    // PyFrame_GetBack, which is defined as follows:
+    //     assert(frame != NULL);
+    //     assert(!_PyFrame_IsIncomplete(frame->f_frame));
+    //     PyFrameObject *back = frame->f_back;
+    //     if (back == NULL) {
+    //         _PyInterpreterFrame *prev = frame->f_frame->previous;
+    //         prev = _PyFrame_GetFirstComplete(prev);
+    //         if (prev) {
+    //             back = _PyFrame_GetFrameObject(prev);
+    //         }
+    //     }
+    //     return (PyFrameObject*)Py_XNewRef(back);
+    if (!iframe->frame_obj) {
+        PyFrameObject dummy_frame;
+        _PyInterpreterFrame dummy_iframe;
+        dummy_frame.f_back = nullptr;
+        dummy_frame.f_frame = &dummy_iframe;
+        // force the iframe to be considered complete without
+        // needing to check its code object:
+        dummy_iframe.owner = FRAME_OWNED_BY_GENERATOR;
+        dummy_iframe.previous = iframe;
+        assert(!_PyFrame_IsIncomplete(&dummy_iframe));
+        // Drop the returned reference immediately; the iframe
+        // continues to hold a strong reference
+        Py_XDECREF(PyFrame_GetBack(&dummy_frame));
+        assert(iframe->frame_obj);
+    }
+    return iframe->frame_obj;
+}
+
+inline bool
+PythonState::is_watermark(const _PyInterpreterFrame* iframe) const noexcept
 {
+    // *iframe* is a complete frame we found by walking down from the
+    // current top frame, so it's safe to look at, but the watermark
+    // may be long gone and its memory reused by a new frame, possibly
+    // with a new frame object at the address we stored too. Only ours
+    // can be tracked by the GC, though (see expose_frames()), and as
+    // long as the watermark frame (which is owned by the thread, so
+    // it can't be unlinked and resumed elsewhere like a generator
+    // frame can) hasn't returned, none of its callers can have either.
+    return iframe == this->watermark_iframe
+        && iframe->owner == FRAME_OWNED_BY_THREAD
+        && iframe->frame_obj == this->watermark_frame_obj
+        && PyObject_GC_IsTracked(reinterpret_cast<PyObject*>(iframe->frame_obj));
+}
+
+inline void
+PythonState::reset_watermark() noexcept
+{
+    this->exposed_boundaries = nullptr;
+    this->watermark_iframe = nullptr;
+    this->watermark_frame_obj = nullptr;
+    this->watermark_boundaries = nullptr;
+}
+
+unsigned int GREENLET_NOINLINE(PythonState::expose_frames)(const StackState& stack_state)
+{
+    this->exposed_boundaries = nullptr;
     if (!this->top_frame()) {
-        return;
+        this->reset_watermark();
+        return 0;
+    }
+    unsigned int rewritten = 0;
+
+    _PyInterpreterFrame* last_complete_iframe = nullptr;
+    // The tail of the list of rewritten frames.
+    _PyInterpreterFrame* last_boundary = nullptr;
+    // The new watermark, and whether we've yet seen the first rewritten
+    // frame at or below it.
+    _PyInterpreterFrame* new_watermark = nullptr;
+    bool new_watermark_boundaries_found = false;
+    _PyInterpreterFrame* new_watermark_boundaries = nullptr;
+    bool reached_watermark = false;
+
+    _PyInterpreterFrame* iframe = this->_top_frame->f_frame;
+    while (true) {
+        _PyInterpreterFrame iframe_copy;
+        if (iframe) {
+            // We must make a copy before looking at the iframe contents,
+            // since iframe might point to a portion of the greenlet's C stack
+            // that was spilled when switching greenlets.
+            stack_state.copy_from_stack(&iframe_copy, iframe, sizeof(*iframe));
+            if (_PyFrame_IsIncomplete(&iframe_copy)) {
+                iframe = iframe_copy.previous;
+                continue;
+            }
+            // If the iframe were OWNED_BY_CSTACK then it would always be
+            // incomplete. Since it's not incomplete, it's not on the C stack
+            // and we can access it through the original `iframe` pointer
+            // directly.  This is important since GetFrameObject might
+            // lazily _create_ the frame object and we don't want the
+            // interpreter to lose track of it.
+            assert(iframe_copy.owner != FRAME_OWNED_BY_CSTACK);
+            assert(iframe->owner == FRAME_OWNED_BY_THREAD
+                   || iframe->owner == FRAME_OWNED_BY_GENERATOR);
+            reached_watermark = this->is_watermark(iframe);
+        }
+        // ``iframe`` is now either a complete frame or the end of the
+        // list. Make the last complete frame we saw point at it,
+        // bypassing any incomplete frames (which may have been on the
+        // C stack) in between the two; at the end of the list this
+        // gives the outermost complete frame a null previous pointer.
+        // Most of the time there's nothing in between and thus
+        // nothing to do. When there is, we're overwriting
+        // last_complete_iframe->previous and need that to be
+        // reversible, so we store the original previous pointer in
+        // the frame object.
+        if (last_complete_iframe && last_complete_iframe->previous != iframe) {
+            PyFrameObject* frame = frame_object_for(last_complete_iframe);
+            set_exposed_slot(frame, EXPOSED_ORIGINAL_PREVIOUS, last_complete_iframe->previous);
+            set_exposed_slot(frame, EXPOSED_PREVIOUS, iframe);
+            set_exposed_slot(frame, EXPOSED_NEXT_BOUNDARY, nullptr);
+            last_complete_iframe->previous = iframe;
+            rewritten++;
+            if (last_boundary) {
+                set_exposed_slot(last_boundary->frame_obj, EXPOSED_NEXT_BOUNDARY,
+                                 last_complete_iframe);
+            }
+            else {
+                this->exposed_boundaries = last_complete_iframe;
+            }
+            last_boundary = last_complete_iframe;
+            if (new_watermark && !new_watermark_boundaries_found) {
+                new_watermark_boundaries_found = true;
+                new_watermark_boundaries = last_complete_iframe;
+            }
+        }
+        if (!iframe || reached_watermark) {
+            break;
+        }
+
+        if (!new_watermark && iframe->owner == FRAME_OWNED_BY_THREAD) {
+            // The interpreter creates the frame object of a running
+            // frame untracked, and only tracks it if it outlives the
+            // frame; deallocating it untracks it. Tracking it early
+            // is harmless (the GC doesn't look inside a frame that's
+            // running) and tells it apart from any new frame object
+            // that later reuses its memory, without our holding a
+            // reference that would keep the frame's locals alive
+            // after it returns.
+            PyObject* frame = reinterpret_cast<PyObject*>(frame_object_for(iframe));
+            if (!PyObject_GC_IsTracked(frame)) {
+                PyObject_GC_Track(frame);
+            }
+            new_watermark = iframe;
+        }
+        last_complete_iframe = iframe;
+        // Frames that are OWNED_BY_FRAME_OBJECT are linked via the
+        // frame's f_back while all others are linked via the iframe's
+        // previous ptr. Since all the frames we traverse are running
+        // as far as the interpreter is concerned, we don't have to
+        // worry about the OWNED_BY_FRAME_OBJECT case.
+        iframe = iframe_copy.previous;
     }
 
-    // See GreenletState::expose_frames() and the comment on frames_were_exposed
-    // for more information about this logic.
-    _PyInterpreterFrame *iframe = this->_top_frame->f_frame;
+    if (reached_watermark) {
+        // Everything from here on out is exactly as we left it the
+        // last time, except that we undid our rewrites when we
+        // resumed; redo them.
+        for (_PyInterpreterFrame* boundary = this->watermark_boundaries;
+             boundary;
+             boundary = exposed_slot(boundary->frame_obj, EXPOSED_NEXT_BOUNDARY)) {
+            boundary->previous = exposed_slot(boundary->frame_obj, EXPOSED_PREVIOUS);
+        }
+        if (last_boundary) {
+            set_exposed_slot(last_boundary->frame_obj, EXPOSED_NEXT_BOUNDARY,
+                             this->watermark_boundaries);
+        }
+        else {
+            this->exposed_boundaries = this->watermark_boundaries;
+        }
+        if (!new_watermark) {
+            new_watermark = this->watermark_iframe;
+            new_watermark_boundaries = this->watermark_boundaries;
+        }
+        else if (!new_watermark_boundaries_found) {
+            new_watermark_boundaries = this->watermark_boundaries;
+        }
+    }
+
+    this->watermark_iframe = new_watermark;
+    this->watermark_frame_obj = new_watermark ? new_watermark->frame_obj : nullptr;
+    this->watermark_boundaries = new_watermark_boundaries;
+    return rewritten;
+}
+
+void GREENLET_NOINLINE(PythonState::unexpose_frames)()
+{
+    // See PythonState::expose_frames() for more information about
+    // this logic. Only the frames on this list were changed.
+    _PyInterpreterFrame* iframe = this->exposed_boundaries;
+    this->exposed_boundaries = nullptr;
     while (iframe != nullptr) {
-        _PyInterpreterFrame *prev_exposed = iframe->previous;
         assert(iframe->frame_obj);
-        memcpy(&iframe->previous, &iframe->frame_obj->_f_frame_data[0],
-               sizeof(void *));
-        iframe = prev_exposed;
+        _PyInterpreterFrame* next = exposed_slot(iframe->frame_obj, EXPOSED_NEXT_BOUNDARY);
+        iframe->previous = exposed_slot(iframe->frame_obj, EXPOSED_ORIGINAL_PREVIOUS);
+        iframe = next;
     }
 }
 #else
 void PythonState::unexpose_frames()
 {}
+
+unsigned int PythonState::expose_frames(const StackState& UNUSED(stack_state))
+{
+    return 0;
+}
+#endif
+
+void PythonState::collect_frames(const StackState& stack_state,
+                                 std::vector<CodeLine>& frames) const
+{
+#if GREENLET_PY311
+    const _PyInterpreterFrame* iframe = this->current_frame;
+    while (iframe) {
+        // As in expose_frames(), the frame may be on the C stack, and
+        // that part of the stack may have been spilled to the heap.
+        _PyInterpreterFrame iframe_copy;
+        stack_state.copy_from_stack(&iframe_copy, iframe, sizeof(*iframe));
+        if (!_PyFrame_IsIncomplete(&iframe_copy)) {
+            PyCodeObject* const code = iframe_copy.f_code;
+            const int lasti = _PyInterpreterFrame_LASTI(&iframe_copy);
+            frames.push_back(CodeLine(
+                OwnedObject::owning(reinterpret_cast<PyObject*>(code)),
+                PyCode_Addr2Line(code, lasti * sizeof(_Py_CODEUNIT))));
+        }
+        iframe = iframe_copy.previous;
+    }
+#else
+    (void)stack_state;
+    for (PyFrameObject* frame = this->_top_frame.borrow(); frame; frame = frame->f_back) {
+        frames.push_back(CodeLine(
+            OwnedObject::owning(reinterpret_cast<PyObject*>(frame->f_code)),
+            PyFrame_GetLineNumber(frame)));
+    }
 #endif
+}
 
 void PythonState::operator>>(PyThreadState *const tstate) noexcept
 {
@@ -235,6 +502,9 @@ inline void PythonState::will_switch_from(PyThreadState *const origin_tstate) no
 void PythonState::set_initial_state(const PyThreadState* const tstate) noexcept
 {
     this->_top_frame = nullptr;
+#if GREENLET_PY312
+    this->reset_watermark();
+#endif
 #if GREENLET_PY312
     this->py_recursion_depth = tstate->py_recursion_limit - tstate->py_recursion_remaining;
     // XXX: TODO: Comment from a reviewer:
@@ -367,6 +637,9 @@ void PythonState::did_finish(PyThreadState* tstate) noexcept
     this->datastack_limit = nullptr;
     this->datastack_top = nullptr;
 #endif
+#if GREENLET_PY312
+    this->reset_watermark();
+#endif
 }
 
 
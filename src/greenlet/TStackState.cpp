@@ -5,6 +5,9 @@
 
 namespace greenlet {
 
+intptr_t StackState::total_stack_copy = 0;
+intptr_t StackState::peak_stack_copy = 0;
+
 #ifdef GREENLET_USE_STDIO
 #include <iostream>
 using std::cerr;
@@ -78,32 +81,39 @@ StackState& StackState::operator=(const StackState& other)
 
 inline void StackState::free_stack_copy() noexcept
 {
+    StackState::total_stack_copy -= this->_stack_saved;
     PyMem_Free(this->stack_copy);
     this->stack_copy = nullptr;
     this->_stack_saved = 0;
 }
 
-inline void StackState::copy_heap_to_stack(const StackState& current) noexcept
+inline void StackState::copy_heap_to_stack(const StackState& current,
+                                           SwitchStats& stats) noexcept
 {
 
     /* Restore the heap copy back into the C stack */
     if (this->_stack_saved != 0) {
         memcpy(this->_stack_start, this->stack_copy, this->_stack_saved);
+        stats.stack_bytes_restored += this->_stack_saved;
         this->free_stack_copy();
     }
     StackState* owner = const_cast<StackState*>(&current);
     if (!owner->_stack_start) {
         owner = owner->stack_prev; /* greenlet is dying, skip it */
     }
+    uint64_t steps = 0;
     while (owner && owner->stack_stop <= this->stack_stop) {
         // cerr << "\tOwner: " << owner << endl;
         owner = owner->stack_prev; /* find greenlet with more stack */
+        steps++;
     }
+    stats.owner_walk(steps);
     this->stack_prev = owner;
     // cerr << "\tFinished with: " << *this << endl;
 }
 
-inline int StackState::copy_stack_to_heap_up_to(const char* const stop) noexcept
+inline intptr_t StackState::copy_stack_to_heap_up_to(const char* const stop,
+                                                     SwitchStats& stats) noexcept
 {
     /* Save more of g's stack into the heap -- at least up to 'stop'
        g->stack_stop |________|
@@ -127,12 +137,19 @@ inline int StackState::copy_stack_to_heap_up_to(const char* const stop) noexcept
         memcpy(c + sz1, this->_stack_start + sz1, sz2 - sz1);
         this->stack_copy = c;
         this->_stack_saved = sz2;
+        stats.stack_reallocs++;
+        stats.stack_bytes_saved += sz2 - sz1;
+        StackState::total_stack_copy += sz2 - sz1;
+        StackState::peak_stack_copy = std::max(StackState::peak_stack_copy,
+                                               StackState::total_stack_copy);
+        return sz2 - sz1;
     }
     return 0;
 }
 
-inline int StackState::copy_stack_to_heap(char* const stackref,
-                                          const StackState& current) noexcept
+inline intptr_t StackState::copy_stack_to_heap(char* const stackref,
+                                               const StackState& current,
+                                               SwitchStats& stats) noexcept
 {
     /* must free all the C stack up to target_stop */
     const char* const target_stop = this->stack_stop;
@@ -146,19 +163,27 @@ inline int StackState::copy_stack_to_heap(char* const stackref,
         owner->_stack_start = stackref;
     }
 
+    intptr_t copied = 0;
+    uint64_t steps = 0;
     while (owner->stack_stop < target_stop) {
         /* ts_current is entierely within the area to free */
-        if (owner->copy_stack_to_heap_up_to(owner->stack_stop)) {
+        const intptr_t n = owner->copy_stack_to_heap_up_to(owner->stack_stop, stats);
+        if (n < 0) {
             return -1; /* XXX */
         }
+        copied += n;
         owner = owner->stack_prev;
+        steps++;
     }
+    stats.owner_walk(steps);
     if (owner != this) {
-        if (owner->copy_stack_to_heap_up_to(target_stop)) {
+        const intptr_t n = owner->copy_stack_to_heap_up_to(target_stop, stats);
+        if (n < 0) {
             return -1; /* XXX */
         }
+        copied += n;
     }
-    return 0;
+    return copied;
 }
 
 inline bool StackState::started() const noexcept
@@ -210,6 +235,21 @@ inline char* StackState::stack_start() const noexcept
     return this->_stack_start;
 }
 
+inline intptr_t StackState::total_stack_copy_bytes() noexcept
+{
+    return StackState::total_stack_copy;
+}
+
+inline intptr_t StackState::peak_stack_copy_bytes() noexcept
+{
+    return StackState::peak_stack_copy;
+}
+
+inline void StackState::reset_peak_stack_copy_bytes() noexcept
+{
+    StackState::peak_stack_copy = StackState::total_stack_copy;
+}
+
 
 inline StackState StackState::make_main() noexcept
 {
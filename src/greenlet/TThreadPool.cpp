@@ -0,0 +1,176 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+/**
+ * Implementation of the native worker threads used by
+ * ``run_in_thread()``.
+ *
+ * Format with:
+ *  clang-format -i --style=file src/greenlet/greenlet.c
+ *
+ *
+ * Fix missing braces with:
+ *   clang-tidy src/greenlet/greenlet.c -fix -checks="readability-braces-around-statements"
+*/
+#ifndef T_THREAD_POOL
+#define T_THREAD_POOL
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "greenlet_internal.hpp"
+#include "greenlet_exceptions.hpp"
+#include "greenlet_thread_support.hpp"
+
+namespace greenlet {
+
+/**
+ * A pool of native threads that run jobs submitted from Python.
+ *
+ * Workers are started (as Python threads, so the interpreter knows
+ * how to deal with them at shutdown) the first time a job finds no
+ * idle worker, up to a limit, and then wait for more jobs forever.
+ * They each keep one Python thread state, and hold the GIL only
+ * while running a job.
+ *
+ * We never hold our mutex while waiting for the GIL, so callers
+ * may hold the GIL while they submit jobs.
+ *
+ * The workers don't survive a fork. In the child,
+ * ``after_fork_in_child()`` forgets them and abandons their jobs.
+ */
+class ThreadPool
+{
+public:
+    class Job
+    {
+    public:
+        virtual ~Job() {}
+        // Called in a worker, holding the GIL. The worker deletes
+        // the job afterwards, still holding the GIL.
+        virtual void run() = 0;
+        // Called instead of, or in the middle of, run(), holding the
+        // GIL, when the process forked and the job's worker is gone.
+        // The job is deleted afterwards.
+        virtual void abandon() = 0;
+    };
+
+private:
+    Mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<Job*> jobs;
+    // The jobs that workers have taken. A worker only removes its
+    // job, holding the GIL, once it's done with it.
+    std::vector<Job*> running;
+    size_t workers;
+    size_t idle_workers;
+    const size_t max_workers;
+
+    G_NO_COPIES_OF_CLS(ThreadPool);
+
+    static void worker(void* arg)
+    {
+        ThreadPool* const self = static_cast<ThreadPool*>(arg);
+        // We're started without the GIL. This makes us a thread
+        // state, which we're the only user of, and takes the GIL.
+        PyGILState_Ensure();
+        PyThreadState* const tstate = PyEval_SaveThread();
+        for (;;) {
+            Job* job;
+            {
+                std::unique_lock<Mutex> lock(self->mutex);
+                self->idle_workers++;
+                self->wakeup.wait(lock, [self]{ return !self->jobs.empty(); });
+                self->idle_workers--;
+                job = self->jobs.front();
+                self->jobs.pop_front();
+                self->running.push_back(job);
+            }
+            PyEval_RestoreThread(tstate);
+            job->run();
+            {
+                LockGuard lock(self->mutex);
+                self->running.erase(std::find(self->running.begin(), self->running.end(), job));
+            }
+            delete job;
+            PyEval_SaveThread();
+        }
+    }
+
+public:
+    ThreadPool()
+        : workers(0),
+          idle_workers(0),
+          max_workers(std::min<size_t>(32, std::thread::hardware_concurrency() + 4))
+    {}
+
+    /**
+     * Run *job*, which we take ownership of, in a worker. Must be
+     * holding the GIL.
+     *
+     * If there are no workers and we can't start one, raises
+     * RuntimeError and deletes the job.
+     */
+    void submit(Job* job)
+    {
+        bool need_worker;
+        {
+            LockGuard lock(this->mutex);
+            this->jobs.push_back(job);
+            need_worker = this->idle_workers < this->jobs.size()
+                && this->workers < this->max_workers;
+            if (need_worker) {
+                this->workers++;
+            }
+        }
+        this->wakeup.notify_one();
+
+        if (need_worker
+            && PyThread_start_new_thread(ThreadPool::worker, this) == PYTHREAD_INVALID_THREAD_ID) {
+            {
+                LockGuard lock(this->mutex);
+                this->workers--;
+                if (this->workers) {
+                    // Somebody will get to it.
+                    return;
+                }
+                this->jobs.erase(std::find(this->jobs.begin(), this->jobs.end(), job));
+            }
+            // Outside the lock: this can run arbitrary code.
+            delete job;
+            throw PyErrOccurred(PyExc_RuntimeError, "can't start new thread");
+        }
+    }
+
+    /**
+     * Called in the child process after a fork, holding the GIL.
+     *
+     * Only the thread that forked exists in the child, so we have no
+     * workers, and our mutex may have been copied while one of them
+     * held it. Start over, and abandon every job that was queued or
+     * running, so that the greenlets waiting for them don't wait
+     * forever.
+     */
+    void after_fork_in_child()
+    {
+        new (&this->mutex) Mutex();
+        new (&this->wakeup) std::condition_variable();
+        this->workers = 0;
+        this->idle_workers = 0;
+        std::vector<Job*> lost(this->running.begin(), this->running.end());
+        lost.insert(lost.end(), this->jobs.begin(), this->jobs.end());
+        this->running.clear();
+        this->jobs.clear();
+        // This can run arbitrary code, including submitting new jobs.
+        for (Job* job : lost) {
+            job->abandon();
+            delete job;
+        }
+    }
+};
+
+}; // namespace greenlet
+
+#endif // T_THREAD_POOL
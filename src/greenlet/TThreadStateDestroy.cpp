@@ -15,6 +15,7 @@
 #include "greenlet_greenlet.hpp"
 #include "greenlet_thread_state.hpp"
 #include "greenlet_thread_support.hpp"
+#include "greenlet_slp_switch.hpp"
 #include "greenlet_cpython_add_pending.hpp"
 #include "TGreenletGlobals.cpp"
 
@@ -141,9 +142,10 @@ struct ThreadState_DestroyNoGIL
             }
 
             mod_globs->queue_to_destroy(state);
-            if (mod_globs->thread_states_to_destroy.size() == 1) {
-                // We added the first item to the queue. We need to schedule
-                // the cleanup.
+            ThreadStateCleanup& cleanup = mod_globs->cleanup();
+            if (!cleanup.pass_scheduled) {
+                // Nothing is going to get to this item yet. We need
+                // to schedule the cleanup.
                 int result = ThreadState_DestroyNoGIL::AddPendingCall(
                     ThreadState_DestroyNoGIL::DestroyQueueWithGIL,
                     NULL);
@@ -153,6 +155,9 @@ struct ThreadState_DestroyNoGIL
                             "greenlet: WARNING: failed in call to Py_AddPendingCall; "
                             "expect a memory leak.\n");
                 }
+                else {
+                    cleanup.pass_scheduled = true;
+                }
             }
         }
     }
@@ -160,25 +165,157 @@ struct ThreadState_DestroyNoGIL
     static int
     DestroyQueueWithGIL(void* UNUSED(arg))
     {
+        {
+            // Anything queued from now on needs another pass
+            // scheduled, unless this one gets to it.
+            LockGuard cleanup_lock(*mod_globs->thread_states_to_destroy_lock);
+            mod_globs->cleanup().pass_scheduled = false;
+        }
+        DestroyQueuePass();
+        return 0;
+    }
+
+    /**
+     * Destroy queued thread states, oldest first, until the queue is
+     * empty or the pass runs out of budget. Must be holding the GIL.
+     *
+     * If a pass runs out of budget, we don't reschedule the pending
+     * call: the interpreter runs all the pending calls it has in one
+     * go, so that would simply continue this pass. Instead, the
+     * leftovers are handled by the next pass, which runs the next
+     * time any thread switches, calls ``greenlet.getcurrent()`` or
+     * exits (see ThreadState_Maintain()), or another thread's state
+     * is queued.
+     */
+    static void
+    DestroyQueuePass()
+    {
+        // Destroying a thread state can run arbitrary Python code,
+        // including calls to getcurrent(); those don't get their own
+        // pass.
+        static bool in_pass = false;
+        if (in_pass) {
+            return;
+        }
+        in_pass = true;
+        typedef ThreadStateCleanup::clock clock;
+        typedef ThreadStateCleanup::duration duration;
+        ThreadStateCleanup& cleanup = mod_globs->cleanup();
+        const clock::time_point begin = clock::now();
+        clock::time_point now = begin;
+        size_t destroyed = 0;
+        duration total_latency(0);
+        duration max_latency(0);
+        bool left_over = false;
+
         // We're holding the GIL here, so no Python code should be able to
         // run to call ``os.fork()``.
         while (1) {
-            ThreadState* to_destroy;
+            cleanup_queue_item_t to_destroy;
             {
                 LockGuard cleanup_lock(*mod_globs->thread_states_to_destroy_lock);
                 if (mod_globs->thread_states_to_destroy.empty()) {
                     break;
                 }
+                if (destroyed && cleanup.budget_exhausted(destroyed, now - begin)) {
+                    left_over = true;
+                    break;
+                }
                 to_destroy = mod_globs->take_next_to_destroy();
             }
+            const duration latency = now - to_destroy.second;
+            total_latency += latency;
+            max_latency = std::max(max_latency, latency);
             // Drop the lock while we do the actual deletion.
-            ThreadState_DestroyWithGIL::DestroyWithGIL(to_destroy);
+            ThreadState_DestroyWithGIL::DestroyWithGIL(to_destroy.first);
+            ++destroyed;
+            now = clock::now();
         }
-        return 0;
+
+        in_pass = false;
+        cleanup.left_over.store(left_over, std::memory_order_relaxed);
+        if (!destroyed) {
+            return;
+        }
+        const duration elapsed = now - begin;
+        LockGuard cleanup_lock(*mod_globs->thread_states_to_destroy_lock);
+        cleanup.passes++;
+        cleanup.destroyed += destroyed;
+        cleanup.max_destroyed_per_pass = std::max(cleanup.max_destroyed_per_pass, destroyed);
+        cleanup.total_time += elapsed;
+        cleanup.max_pass_time = std::max(cleanup.max_pass_time, elapsed);
+        cleanup.total_latency += total_latency;
+        cleanup.max_latency = std::max(cleanup.max_latency, max_latency);
     }
 
 };
 
+/**
+ * Kill the greenlets that other threads released for *state*'s
+ * thread, and destroy the thread states that a budgeted pass left
+ * behind, if there are any. Must be called in *state*'s thread,
+ * holding the GIL. Any pending exception is preserved.
+ *
+ * Both can run arbitrary code and switch, so this does nothing in
+ * the middle of a switch. It's called at the end of every switch, and
+ * also where a thread that never switches would otherwise keep that
+ * garbage forever: getcurrent(), creating a greenlet, the main
+ * thread's pending call, and the thread's exit. When there's nothing
+ * to do, it's two loads.
+ */
+static inline void
+ThreadState_Maintain(ThreadState& state)
+{
+    const bool left_over = mod_globs->cleanup().left_over.load(std::memory_order_relaxed);
+    if ((!state.has_deleteme() && !left_over) || switching_thread_state) {
+        return;
+    }
+    PyErrPieces saved_err;
+    state.clear_deleteme_list();
+    if (left_over) {
+        ThreadState_DestroyNoGIL::DestroyQueuePass();
+    }
+    saved_err.PyErrRestore();
+}
+
+int
+ThreadState::clear_deleteme_list_pending(void*)
+{
+    // Pending calls run with the GIL in whatever main-thread greenlet
+    // happens to be running; the thread's state may already be gone,
+    // or a switch may already have drained the list.
+    ThreadState* const state = g_thread_state_cache;
+    if (!state || !state->has_deleteme()) {
+        return 0;
+    }
+    if (!switching_thread_state) {
+        ThreadState_Maintain(*state);
+        return 0;
+    }
+    if (state->switch_wakeup) {
+        // Calling it could let the state be destroyed.
+        const OwnedObject wakeup(state->switch_wakeup);
+        if (!OwnedObject::consuming(PyObject_CallObject(wakeup.borrow(), nullptr))) {
+            PyErr_WriteUnraisable(wakeup.borrow());
+        }
+    }
+    return 0;
+}
+
+void
+ThreadState::clear_deleteme_list_at_exit_capsule(PyObject* capsule)
+{
+    ThreadState* const state = static_cast<ThreadState*>(
+        PyCapsule_GetPointer(capsule, "greenlet.ThreadState"));
+    // Interpreter finalization clears the dictionaries of every
+    // thread, from the thread doing the finalizing, and it's too late
+    // to be running greenlets anyway.
+    if (state != g_thread_state_cache || _Py_IsFinalizing()) {
+        return;
+    }
+    ThreadState_Maintain(*state);
+}
+
 }; // namespace greenlet
 
 // The intent when GET_THREAD_STATE() is needed multiple times in a
@@ -190,6 +327,34 @@ struct ThreadState_DestroyNoGIL
 // offset.
 typedef greenlet::ThreadStateCreator<greenlet::ThreadState_DestroyNoGIL> ThreadStateCreator;
 static thread_local ThreadStateCreator g_thread_state_global;
-#define GET_THREAD_STATE() g_thread_state_global
+
+// GET_THREAD_STATE() is used on every switch and every getcurrent().
+// Once the ThreadState exists, this finds it with a single read of
+// ``g_thread_state_cache``; only the first access in a thread (or
+// one after the state has been destroyed) goes to the creator.
+class CurrentThreadState
+{
+public:
+    inline greenlet::ThreadState& state() const
+    {
+        greenlet::ThreadState* const cached = greenlet::g_thread_state_cache;
+        if (cached) {
+            return *cached;
+        }
+        return g_thread_state_global.state();
+    }
+
+    operator greenlet::ThreadState&() const
+    {
+        return this->state();
+    }
+
+    operator greenlet::ThreadState*() const
+    {
+        return &this->state();
+    }
+};
+
+#define GET_THREAD_STATE() CurrentThreadState()
 
 #endif //T_THREADSTATE_DESTROY
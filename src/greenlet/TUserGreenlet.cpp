@@ -34,9 +34,15 @@ void UserGreenlet::operator delete(void* ptr)
 
 
 UserGreenlet::UserGreenlet(PyGreenlet* p, BorrowedGreenlet the_parent)
-    : Greenlet(p), _parent(the_parent)
+    : Greenlet(p),
+      _parent(the_parent),
+      _lineage_cache_epoch(0),
+      _lineage_depth(0)
 {
     this->_self = p;
+    if (the_parent) {
+        the_parent->_may_have_children = true;
+    }
 }
 
 UserGreenlet::~UserGreenlet()
@@ -45,7 +51,11 @@ UserGreenlet::~UserGreenlet()
     // when deleting an unfinished greenlet,
     // TestLeaks.test_untracked_memory_doesnt_increase_unfinished_thread_dealloc_in_main fails.
     this->python_state.did_finish(nullptr);
-    this->tp_clear();
+    // Not tp_clear(): nothing can have us in its parent chain anymore
+    // (it would own a reference to us), so no lineage cache is
+    // affected.
+    Greenlet::tp_clear();
+    this->clear_references();
 }
 
 BorrowedGreenlet
@@ -71,13 +81,44 @@ UserGreenlet::find_main_greenlet_in_lineage() const
         return BorrowedMainGreenlet(this->_main_greenlet);
     }
 
+    this->update_lineage_cache();
+    return this->_lineage_main_greenlet;
+}
+
+Py_ssize_t
+UserGreenlet::lineage_depth() const
+{
+    this->update_lineage_cache();
+    return this->_lineage_depth;
+}
+
+void
+UserGreenlet::lineage_changed() noexcept
+{
+    Greenlet::lineage_changed();
+    this->_lineage_cache_epoch = 0;
+}
+
+void
+UserGreenlet::update_lineage_cache() const
+{
+    if (this->_lineage_cache_epoch == lineage_epoch) {
+        return;
+    }
+
     if (!this->_parent) {
         /* garbage collected greenlet in chain */
         // XXX: WHAT?
-        return BorrowedMainGreenlet(nullptr);
+        this->_lineage_main_greenlet = nullptr;
+        this->_lineage_depth = 0;
     }
-
-    return this->_parent->find_main_greenlet_in_lineage();
+    else {
+        // The parent's answers are cached too, so after an
+        // invalidation, only the first greenlet asked walks the chain.
+        this->_lineage_main_greenlet = this->_parent->find_main_greenlet_in_lineage();
+        this->_lineage_depth = this->_parent->lineage_depth() + 1;
+    }
+    this->_lineage_cache_epoch = lineage_epoch;
 }
 
 
@@ -283,6 +324,12 @@ UserGreenlet::g_initialstub(void* mark)
 #endif
     /* start the greenlet */
     ThreadState& thread_state = GET_THREAD_STATE().state();
+    // Once started, we (and our children) answer with our own main
+    // greenlet, not what our parents lead to; normally that's the
+    // same thing, or we couldn't have switched here.
+    if (this->find_main_greenlet_in_lineage() != thread_state.borrow_main_greenlet()) {
+        this->lineage_changed();
+    }
     this->stack_state = StackState(mark,
                                    thread_state.borrow_current()->stack_state);
     this->python_state.set_initial_state(PyThreadState_GET());
@@ -366,6 +413,7 @@ UserGreenlet::g_initialstub(void* mark)
     if (err.status < 0) {
         /* start failed badly, restore greenlet state */
         this->stack_state = StackState();
+        this->lineage_changed();
         this->_main_greenlet.CLEAR();
         // CAUTION: This may run arbitrary Python code.
         run.CLEAR(); // inner_bootstrap didn't run, we own the reference.
@@ -408,6 +456,7 @@ UserGreenlet::inner_bootstrap(PyGreenlet* origin_greenlet, PyObject* run)
     // EXCEPT: That can't be true, we access run, among others, here.
 
     this->stack_state.set_active(); /* running */
+    this->thread_state()->add_live_greenlet(this->_live_link);
 
     // We're about to possibly run Python code again, which
     // could switch back/away to/from us, so we need to grab the
@@ -426,9 +475,15 @@ UserGreenlet::inner_bootstrap(PyGreenlet* origin_greenlet, PyObject* run)
     // The first switch we need to manually call the trace
     // function here instead of in g_switch_finish, because we
     // never return there.
+    const uint64_t trace_started = this->thread_state()->borrow_switch_timing()
+        && (this->thread_state()->has_native_trace() || this->thread_state()->has_tracefunc())
+        ? SwitchTiming::now() : 0;
+    this->thread_state()->call_native_trace(
+        args ? PyGreenlet_TRACE_START : PyGreenlet_TRACE_THROW,
+        origin_greenlet,
+        this->_self);
     if (OwnedObject tracefunc = this->thread_state()->get_tracefunc()) {
-        OwnedGreenlet trace_origin;
-        trace_origin = origin_greenlet;
+        OwnedGreenlet trace_origin(BorrowedGreenlet::trusted(origin_greenlet));
         try {
             g_calltrace(tracefunc,
                         args ? mod_globs->event_switch : mod_globs->event_throw,
@@ -440,6 +495,9 @@ UserGreenlet::inner_bootstrap(PyGreenlet* origin_greenlet, PyObject* run)
             args.CLEAR();
         }
     }
+    if (SwitchTiming* const timing = this->thread_state()->borrow_switch_timing()) {
+        timing->finish_switch(trace_started);
+    }
 
     // We no longer need the origin, it was only here for
     // tracing.
@@ -531,6 +589,7 @@ UserGreenlet::inner_bootstrap(PyGreenlet* origin_greenlet, PyObject* run)
 
     /* jump back to parent */
     this->stack_state.set_inactive(); /* dead */
+    this->forget_live();
 
 
     // TODO: Can we decref some things here? Release our main greenlet
@@ -593,17 +652,25 @@ UserGreenlet::parent(const BorrowedObject raw_new_parent)
         throw AttributeError("can't delete attribute");
     }
 
-    BorrowedMainGreenlet main_greenlet_of_new_parent;
     BorrowedGreenlet new_parent(raw_new_parent.borrow()); // could
                                                           // throw
                                                           // TypeError!
-    for (BorrowedGreenlet p = new_parent; p; p = p->parent()) {
-        if (p == this->_self) {
-            throw ValueError("cyclic parent chain");
+
+    // We can only be in the parent chain of a greenlet if we have
+    // children, and if it's deeper than we are; go up from the new
+    // parent to our depth and see if that's us.
+    BorrowedGreenlet p = new_parent;
+    if (this->_may_have_children) {
+        const Py_ssize_t depth = this->lineage_depth();
+        for (Py_ssize_t p_depth = p->lineage_depth(); p_depth > depth; --p_depth) {
+            p = p->parent();
         }
-        main_greenlet_of_new_parent = p->main_greenlet();
+    }
+    if (p == this->_self) {
+        throw ValueError("cyclic parent chain");
     }
 
+    const BorrowedMainGreenlet main_greenlet_of_new_parent = new_parent->find_main_greenlet_in_lineage();
     if (!main_greenlet_of_new_parent) {
         throw ValueError("parent must not be garbage collected");
     }
@@ -613,12 +680,15 @@ UserGreenlet::parent(const BorrowedObject raw_new_parent)
         throw ValueError("parent cannot be on a different thread");
     }
 
+    this->lineage_changed();
     this->_parent = new_parent;
+    new_parent->_may_have_children = true;
 }
 
 void
 UserGreenlet::murder_in_place()
 {
+    this->lineage_changed();
     this->_main_greenlet.CLEAR();
     Greenlet::murder_in_place();
 }
@@ -644,10 +714,17 @@ int
 UserGreenlet::tp_clear()
 {
     Greenlet::tp_clear();
+    this->lineage_changed();
+    this->clear_references();
+    return 0;
+}
+
+void
+UserGreenlet::clear_references()
+{
     this->_parent.CLEAR();
     this->_main_greenlet.CLEAR();
     this->_run_callable.CLEAR();
-    return 0;
 }
 
 UserGreenlet::ParentIsCurrentGuard::ParentIsCurrentGuard(UserGreenlet* p,
@@ -655,11 +732,14 @@ UserGreenlet::ParentIsCurrentGuard::ParentIsCurrentGuard(UserGreenlet* p,
     : oldparent(p->_parent),
       greenlet(p)
 {
+    p->lineage_changed();
     p->_parent = thread_state.get_current();
+    p->_parent->_may_have_children = true;
 }
 
 UserGreenlet::ParentIsCurrentGuard::~ParentIsCurrentGuard()
 {
+    this->greenlet->lineage_changed();
     this->greenlet->_parent = oldparent;
     oldparent.CLEAR();
 }
@@ -0,0 +1,248 @@
+/* -*- indent-tabs-mode: nil; tab-width: 4; -*- */
+/**
+ * Implementation of the watchdog thread used by
+ * ``start_watchdog()``.
+ *
+ * Format with:
+ *  clang-format -i --style=file src/greenlet/greenlet.c
+ *
+ *
+ * Fix missing braces with:
+ *   clang-tidy src/greenlet/greenlet.c -fix -checks="readability-braces-around-statements"
+*/
+#ifndef T_WATCHDOG
+#define T_WATCHDOG
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "greenlet_internal.hpp"
+#include "greenlet_exceptions.hpp"
+#include "greenlet_thread_state.hpp"
+#include "greenlet_thread_support.hpp"
+
+namespace greenlet {
+
+/**
+ * A native thread that notices when a watched thread stops
+ * switching greenlets for too long.
+ *
+ * Watched threads bump a counter in their StallWatch on every
+ * switch. The watchdog samples the counters without the GIL, several
+ * times per threshold, so watching costs the watched threads nothing
+ * but an atomic increment. Only when a counter hasn't moved for the
+ * watch's threshold does the watchdog take the GIL, to report the
+ * stall (once per stall).
+ *
+ * Like the ThreadPool workers, it is a Python thread, started the
+ * first time something is watched, and waits forever afterwards; in
+ * a forked child, ``after_fork_in_child()`` starts it again.
+ */
+class Watchdog
+{
+private:
+    typedef std::shared_ptr<StallWatch> WatchPtr;
+
+    struct Stall
+    {
+        WatchPtr watch;
+        uint64_t switches;
+        std::chrono::nanoseconds duration;
+    };
+
+    Mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<WatchPtr> watches;
+    bool started;
+
+    G_NO_COPIES_OF_CLS(Watchdog);
+
+    /**
+     * Forget stopped watches, wait until it's time to look again, and
+     * return the watches that stalled since we last looked.
+     */
+    std::vector<Stall> find_stalls()
+    {
+        std::vector<Stall> stalls;
+        std::unique_lock<Mutex> lock(this->mutex);
+        this->watches.erase(
+            std::remove_if(this->watches.begin(), this->watches.end(),
+                           [](const WatchPtr& w) { return w->stopped.load(); }),
+            this->watches.end());
+        if (this->watches.empty()) {
+            this->wakeup.wait(lock);
+            return stalls;
+        }
+
+        std::chrono::nanoseconds interval = this->watches[0]->threshold;
+        for (const WatchPtr& watch : this->watches) {
+            interval = std::min(interval, watch->threshold);
+        }
+        this->wakeup.wait_for(
+            lock,
+            std::max<std::chrono::nanoseconds>(interval / 4, std::chrono::milliseconds(1)));
+
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (const WatchPtr& watch : this->watches) {
+            const uint64_t switches = watch->switches.load(std::memory_order_acquire);
+            if (switches != watch->seen_switches) {
+                watch->seen_switches = switches;
+                watch->seen_at = now;
+                watch->reported = false;
+            }
+            else if (!watch->reported && now - watch->seen_at >= watch->threshold) {
+                watch->reported = true;
+                stalls.push_back(Stall{watch, switches, now - watch->seen_at});
+            }
+        }
+        return stalls;
+    }
+
+    /**
+     * Call the callback of a stalled watch. Must hold the GIL.
+     */
+    static void report(const Stall& stall)
+    {
+        StallWatch& watch = *stall.watch;
+        // Holding the GIL, the thread can't have exited all the way
+        // (destroying its state takes the GIL), so if it still hasn't
+        // switched, ``current`` is still its current greenlet and
+        // still alive.
+        if (watch.stopped || watch.switches.load() != stall.switches) {
+            return;
+        }
+        const OwnedObject callback(watch.callback);
+        const OwnedObject greenlet = OwnedObject::owning(
+            reinterpret_cast<PyObject*>(watch.current.load()));
+        const double seconds = std::chrono::duration<double>(stall.duration).count();
+        try {
+            // The frame the thread is running, if it's running Python code.
+            OwnedObject frame = OwnedObject::None();
+            const OwnedObject frames = OwnedObject::consuming(
+                Require(_PyThread_CurrentFrames()));
+            const OwnedObject thread_id = OwnedObject::consuming(
+                Require(PyLong_FromUnsignedLong(watch.thread_id)));
+            if (PyObject* const f = PyDict_GetItem(frames.borrow(), thread_id.borrow())) {
+                frame = OwnedObject::owning(f);
+            }
+
+            if (callback.is_None()) {
+                // Just print what it was doing. (Not using the
+                // greenlet's repr, which would need a greenlet
+                // state for this thread.)
+                PySys_FormatStderr(
+                    "greenlet: <%s object at %p> in thread %lu hasn't switched for %s seconds\n",
+                    Py_TYPE(greenlet.borrow())->tp_name,
+                    greenlet.borrow(),
+                    watch.thread_id,
+                    std::to_string(seconds).c_str());
+                if (!frame.is_None()) {
+                    const OwnedObject traceback = OwnedObject::consuming(
+                        Require(PyImport_ImportModule("traceback")));
+                    OwnedObject::consuming(Require(PyObject_CallMethod(
+                        traceback.borrow(), "print_stack", "O", frame.borrow())));
+                }
+            }
+            else {
+                OwnedObject::consuming(Require(PyObject_CallFunction(
+                    callback.borrow(), "OOd", greenlet.borrow(), frame.borrow(), seconds)));
+            }
+        }
+        catch (const PyErrOccurred&) {
+            PyErr_WriteUnraisable(callback.borrow());
+        }
+    }
+
+    static void run(void* arg)
+    {
+        Watchdog* const self = static_cast<Watchdog*>(arg);
+        // Like a ThreadPool worker, we're started without the GIL,
+        // and this takes it.
+        PyGILState_Ensure();
+        PyThreadState* const tstate = PyEval_SaveThread();
+        for (;;) {
+            const std::vector<Stall> stalls = self->find_stalls();
+            if (!stalls.empty()) {
+                PyEval_RestoreThread(tstate);
+                for (const Stall& stall : stalls) {
+                    report(stall);
+                }
+                // Dropping our references here can't destroy a watch
+                // that still has a callback: the thread's state has one too
+                // until it stops the watch.
+                PyEval_SaveThread();
+            }
+        }
+    }
+
+public:
+    Watchdog()
+        : started(false)
+    {}
+
+    /**
+     * Start watching *watch*. Must be holding the GIL.
+     */
+    void watch(const WatchPtr& watch)
+    {
+        bool start;
+        {
+            LockGuard lock(this->mutex);
+            this->watches.push_back(watch);
+            start = !this->started;
+            this->started = true;
+        }
+        this->wakeup.notify_one();
+
+        if (start && PyThread_start_new_thread(Watchdog::run, this) == PYTHREAD_INVALID_THREAD_ID) {
+            {
+                LockGuard lock(this->mutex);
+                this->started = false;
+                this->watches.pop_back();
+            }
+            throw PyErrOccurred(PyExc_RuntimeError, "can't start new thread");
+        }
+    }
+
+    /**
+     * Called in the child process after a fork, holding the GIL.
+     *
+     * Our thread is gone, and so are the threads we watched, except
+     * the one that forked; our mutex may have been copied while we
+     * held it. Start over, watching just that thread.
+     */
+    void after_fork_in_child()
+    {
+        new (&this->mutex) Mutex();
+        new (&this->wakeup) std::condition_variable();
+        this->started = false;
+        std::vector<WatchPtr> watches;
+        watches.swap(this->watches);
+        const unsigned long thread_id = PyThread_get_thread_ident();
+        for (const WatchPtr& watch : watches) {
+            if (watch->stopped) {
+                continue;
+            }
+            if (watch->thread_id != thread_id) {
+                watch->stop();
+                continue;
+            }
+            watch->seen_at = std::chrono::steady_clock::now();
+            watch->reported = false;
+            try {
+                this->watch(watch);
+            }
+            catch (const PyErrOccurred&) {
+                PyErr_WriteUnraisable(watch->callback.borrow());
+            }
+        }
+    }
+};
+
+}; // namespace greenlet
+
+#endif // T_WATCHDOG
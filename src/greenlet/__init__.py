@@ -13,11 +13,34 @@ __all__ = [
     'GreenletExit',
     'error',
 
+    'dump_stacks',
+    'enumerate',
     'getcurrent',
     'greenlet',
 
+    'run_in_thread',
+    'run_pending_switches',
+    'set_switch_wakeup',
+
     'gettrace',
     'settrace',
+
+    'get_stats',
+    'reset_stats',
+    'start_watchdog',
+    'stop_watchdog',
+
+    'enable_accounting',
+
+    'SWITCH_HISTOGRAM_BOUNDS',
+    'enable_switch_histograms',
+    'get_switch_histograms',
+
+    'SWITCH_LOG_EVENTS',
+    'SWITCH_LOG_FORMAT',
+    'drain_switch_log',
+    'start_switch_log',
+    'stop_switch_log',
 ]
 
 # pylint:disable=no-name-in-module
@@ -37,9 +60,15 @@ from ._greenlet import error
 ###
 # greenlets
 ###
+from ._greenlet import dump_stacks
+from ._greenlet import enumerate
 from ._greenlet import getcurrent
 from ._greenlet import greenlet
 
+from ._greenlet import run_in_thread
+from ._greenlet import run_pending_switches
+from ._greenlet import set_switch_wakeup
+
 ###
 # tracing
 ###
@@ -52,6 +81,23 @@ except ImportError:
     # so this branch should be dead code.
     pass
 
+from ._greenlet import get_stats
+from ._greenlet import reset_stats
+from ._greenlet import start_watchdog
+from ._greenlet import stop_watchdog
+
+from ._greenlet import enable_accounting
+
+from ._greenlet import SWITCH_HISTOGRAM_BOUNDS
+from ._greenlet import enable_switch_histograms
+from ._greenlet import get_switch_histograms
+
+from ._greenlet import SWITCH_LOG_EVENTS
+from ._greenlet import SWITCH_LOG_FORMAT
+from ._greenlet import drain_switch_log
+from ._greenlet import start_switch_log
+from ._greenlet import stop_switch_log
+
 ###
 # Constants
 # These constants aren't documented and aren't recommended.
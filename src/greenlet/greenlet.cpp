@@ -6,6 +6,7 @@
  * Fix missing braces with:
  *   clang-tidy src/greenlet/greenlet.c -fix -checks="readability-braces-around-statements"
 */
+#include <cmath>
 #include <cstdlib>
 #include <string>
 #include <algorithm>
@@ -35,6 +36,8 @@
 #include "TExceptionState.cpp"
 #include "TPythonState.cpp"
 #include "TStackState.cpp"
+#include "TThreadPool.cpp"
+#include "TWatchdog.cpp"
 
 
 using greenlet::LockGuard;
@@ -50,6 +53,17 @@ using greenlet::UserGreenlet;
 using greenlet::MainGreenlet;
 using greenlet::BrokenGreenlet;
 using greenlet::ThreadState;
+using greenlet::PendingSwitch;
+using greenlet::ThreadPool;
+using greenlet::StallWatch;
+using greenlet::SwitchLog;
+using greenlet::SwitchRecord;
+using greenlet::SwitchStats;
+using greenlet::SwitchTiming;
+using greenlet::LatencyHistogram;
+using greenlet::StackState;
+using greenlet::ThreadStateCleanup;
+using greenlet::ThreadState_DestroyNoGIL;
 using greenlet::PythonState;
 
 
@@ -215,7 +229,9 @@ green_new(PyTypeObject* type, PyObject* UNUSED(args), PyObject* UNUSED(kwds))
     PyGreenlet* o =
         (PyGreenlet*)PyBaseObject_Type.tp_new(type, mod_globs->empty_tuple, mod_globs->empty_dict);
     if (o) {
-        new UserGreenlet(o, GET_THREAD_STATE().state().borrow_current());
+        ThreadState& state = GET_THREAD_STATE();
+        ThreadState_Maintain(state);
+        new UserGreenlet(o, state.borrow_current());
         assert(Py_REFCNT(o) == 1);
     }
     return o;
@@ -227,7 +243,9 @@ green_unswitchable_new(PyTypeObject* type, PyObject* UNUSED(args), PyObject* UNU
     PyGreenlet* o =
         (PyGreenlet*)PyBaseObject_Type.tp_new(type, mod_globs->empty_tuple, mod_globs->empty_dict);
     if (o) {
-        new BrokenGreenlet(o, GET_THREAD_STATE().state().borrow_current());
+        ThreadState& state = GET_THREAD_STATE();
+        ThreadState_Maintain(state);
+        new BrokenGreenlet(o, state.borrow_current());
         assert(Py_REFCNT(o) == 1);
     }
     return o;
@@ -607,6 +625,177 @@ green_throw(PyGreenlet* self, PyObject* args)
     }
 }
 
+/**
+ * Queue a switch (or throw) into *self* for the thread it belongs to.
+ * Any thread may call this, holding the GIL.
+ *
+ * Raises the same errors switching from another thread would,
+ * if the greenlet can never run again.
+ */
+static void
+queue_switch_threadsafe(BorrowedGreenlet self,
+                        const BorrowedObject args,
+                        const BorrowedObject kwargs,
+                        const bool is_throw)
+{
+    const BorrowedMainGreenlet main_greenlet = self->find_main_greenlet_in_lineage();
+    if (!main_greenlet) {
+        throw PyErrOccurred(mod_globs->PyExc_GreenletError,
+                            "cannot switch to a garbage collected greenlet");
+    }
+    ThreadState* const state = main_greenlet->thread_state();
+    if (!state) {
+        throw PyErrOccurred(mod_globs->PyExc_GreenletError,
+                            "cannot switch to a different thread (which happens to have exited)");
+    }
+
+    const OwnedObject wakeup = state->push_pending_switch(
+        new PendingSwitch(self, args, kwargs, is_throw));
+    if (wakeup) {
+        // The switch is queued no matter what this does.
+        if (!OwnedObject::consuming(PyObject_CallObject(wakeup.borrow(), nullptr))) {
+            PyErr_WriteUnraisable(wakeup.borrow());
+        }
+    }
+}
+
+/**
+ * A call made by run_in_thread(). When it's done, it queues a switch
+ * (or throw) back into the greenlet that made it.
+ */
+class OffloadedCall : public ThreadPool::Job
+{
+private:
+    const OwnedGreenlet target;
+    const OwnedObject function;
+    const OwnedObject args;
+    const OwnedObject kwargs;
+    // Whether we've queued the switch back (or tried to).
+    bool delivered;
+
+public:
+    OffloadedCall(const BorrowedGreenlet& target,
+                  const BorrowedObject function,
+                  const BorrowedObject args,
+                  const BorrowedObject kwargs)
+        : target(target),
+          function(function),
+          args(args),
+          kwargs(kwargs),
+          delivered(false)
+    {}
+
+    virtual void run()
+    {
+        const OwnedObject result = OwnedObject::consuming(
+            PyObject_Call(this->function.borrow(), this->args.borrow(), this->kwargs.borrow()));
+        this->delivered = true;
+        try {
+            if (result) {
+                const OwnedObject switch_args = OwnedObject::consuming(
+                    Require(PyTuple_Pack(1, result.borrow())));
+                queue_switch_threadsafe(this->target, switch_args, nullptr, false);
+            }
+            else {
+                PyObject* typ;
+                PyObject* val;
+                PyObject* tb;
+                PyErr_Fetch(&typ, &val, &tb);
+                PyErr_NormalizeException(&typ, &val, &tb);
+                const OwnedObject owned_typ = OwnedObject::consuming(typ);
+                const OwnedObject owned_val = OwnedObject::consuming(val);
+                const OwnedObject owned_tb = OwnedObject::consuming(tb);
+                const OwnedObject throw_args = OwnedObject::consuming(
+                    Require(PyTuple_Pack(3,
+                                         typ,
+                                         val ? val : Py_None,
+                                         tb ? tb : Py_None)));
+                queue_switch_threadsafe(this->target, throw_args, nullptr, true);
+            }
+        }
+        catch (const PyErrOccurred&) {
+            // Most likely, the greenlet's thread has exited.
+            PyErr_WriteUnraisable(this->function.borrow());
+        }
+    }
+
+    virtual void abandon()
+    {
+        if (this->delivered) {
+            return;
+        }
+        this->delivered = true;
+        try {
+            const OwnedObject error = OwnedObject::consuming(Require(PyObject_CallFunction(
+                PyExc_RuntimeError, "s",
+                "run_in_thread() call lost: the process forked while it was running")));
+            const OwnedObject throw_args = OwnedObject::consuming(
+                Require(PyTuple_Pack(1, error.borrow())));
+            queue_switch_threadsafe(this->target, throw_args, nullptr, true);
+        }
+        catch (const PyErrOccurred&) {
+            PyErr_WriteUnraisable(this->function.borrow());
+        }
+    }
+};
+
+PyDoc_STRVAR(
+    green_switch_threadsafe_doc,
+    "switch_threadsafe(*args, **kwargs)\n"
+    "\n"
+    "Arrange for the thread this greenlet belongs to to call\n"
+    "``switch(*args, **kwargs)`` on it, and return immediately.\n"
+    "\n"
+    "This may be called from any thread. The switch happens the next\n"
+    "time the owning thread calls :func:`run_pending_switches`; see\n"
+    ":func:`set_switch_wakeup` for a way to let it know.\n"
+    "\n"
+    ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+green_switch_threadsafe(PyGreenlet* self, PyObject* args, PyObject* kwargs)
+{
+    try {
+        queue_switch_threadsafe(self, args, kwargs, false);
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(
+    green_throw_threadsafe_doc,
+    "throw_threadsafe([typ, [val, [tb]]])\n"
+    "\n"
+    "Like :meth:`switch_threadsafe`, but for :meth:`throw`. The arguments\n"
+    "are checked now.\n"
+    "\n"
+    ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+green_throw_threadsafe(PyGreenlet* self, PyObject* args)
+{
+    PyArgParseParam typ(mod_globs->PyExc_GreenletExit);
+    PyArgParseParam val;
+    PyArgParseParam tb;
+
+    if (!PyArg_ParseTuple(args, "|OOO:throw_threadsafe", &typ, &val, &tb)) {
+        return nullptr;
+    }
+
+    try {
+        // Raise any problems with the exception here, rather than
+        // in the other thread.
+        PyErrPieces err_pieces(typ.borrow(), val.borrow(), tb.borrow());
+        queue_switch_threadsafe(self, args, nullptr, true);
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
 static int
 green_bool(PyGreenlet* self)
 {
@@ -763,6 +952,62 @@ green_getframe(BorrowedGreenlet self, void* UNUSED(context))
 }
 
 
+// The accounting of *self*, including the time it has been running
+// for if it is the current greenlet of this thread.
+static greenlet::Accounting
+green_accounting(BorrowedGreenlet self)
+{
+    greenlet::Accounting accounting = self->accounting();
+    const ThreadState& state = GET_THREAD_STATE();
+    if (state.is_current(self)) {
+        accounting.stop(greenlet::Accounting::monotonic_ns(), state.accounting_cpu_now());
+    }
+    return accounting;
+}
+
+static PyObject*
+green_get_run_time(BorrowedGreenlet self, void* UNUSED(context))
+{
+    return PyFloat_FromDouble(green_accounting(self).run_time / 1e9);
+}
+
+static PyObject*
+green_get_cpu_time(BorrowedGreenlet self, void* UNUSED(context))
+{
+    return PyFloat_FromDouble(green_accounting(self).cpu_time / 1e9);
+}
+
+static PyObject*
+green_get_switches(BorrowedGreenlet self, void* UNUSED(context))
+{
+    return PyLong_FromUnsignedLongLong(self->accounting().switches);
+}
+
+static PyObject*
+green_get_last_switch_in(BorrowedGreenlet self, void* UNUSED(context))
+{
+    const uint64_t switched_in = self->accounting().switched_in;
+    if (!switched_in) {
+        Py_RETURN_NONE;
+    }
+    // steady_clock isn't always the clock of time.monotonic() (it
+    // isn't on Windows, for one), so report it on that clock by how
+    // long ago it was.
+    const double age = (greenlet::Accounting::monotonic_ns() - switched_in) / 1e9;
+    try {
+        const NewReference time_module(Require(PyImport_ImportModule("time")));
+        const NewReference now(Require(PyObject_CallMethod(time_module.borrow(), "monotonic", NULL)));
+        const double monotonic = PyFloat_AsDouble(now.borrow());
+        if (monotonic == -1.0 && PyErr_Occurred()) {
+            return nullptr;
+        }
+        return PyFloat_FromDouble(monotonic - age);
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
 static PyObject*
 green_getstate(PyGreenlet* self)
 {
@@ -845,7 +1090,17 @@ extern "C" {
 static PyGreenlet*
 PyGreenlet_GetCurrent(void)
 {
-    return GET_THREAD_STATE().state().get_current().relinquish_ownership();
+    ThreadState& state = GET_THREAD_STATE();
+    ThreadState_Maintain(state);
+    return state.get_current().relinquish_ownership();
+}
+
+static PyGreenlet*
+PyGreenlet_GetCurrentBorrowed(void)
+{
+    ThreadState& state = GET_THREAD_STATE();
+    ThreadState_Maintain(state);
+    return state.borrow_current();
 }
 
 static int
@@ -920,6 +1175,62 @@ PyGreenlet_Throw(PyGreenlet* self, PyObject* typ, PyObject* val, PyObject* tb)
     }
 }
 
+static int
+PyGreenlet_SwitchThreadsafe(PyGreenlet* self, PyObject* args, PyObject* kwargs)
+{
+    if (!PyGreenlet_Check(self)) {
+        PyErr_BadArgument();
+        return -1;
+    }
+
+    if (args == NULL) {
+        args = mod_globs->empty_tuple;
+    }
+
+    if (kwargs == NULL || !PyDict_Check(kwargs)) {
+        kwargs = NULL;
+    }
+
+    try {
+        queue_switch_threadsafe(self, args, kwargs, false);
+    }
+    catch (const PyErrOccurred&) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+PyGreenlet_ThrowThreadsafe(PyGreenlet* self, PyObject* typ, PyObject* val, PyObject* tb)
+{
+    if (!PyGreenlet_Check(self)) {
+        PyErr_BadArgument();
+        return -1;
+    }
+    try {
+        PyErrPieces err_pieces(typ, val, tb);
+        const OwnedObject args = OwnedObject::consuming(
+            Py_BuildValue("(OOO)", typ, val ? val : Py_None, tb ? tb : Py_None));
+        Require(args.borrow());
+        queue_switch_threadsafe(self, args, nullptr, true);
+    }
+    catch (const PyErrOccurred&) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+PyGreenlet_SetNativeTrace(PyGreenlet_TraceFunc func, void* context, int mask)
+{
+    if (mask & ~PyGreenlet_TRACE_ALL) {
+        PyErr_SetString(PyExc_ValueError, "unknown trace events in mask");
+        return -1;
+    }
+    GET_THREAD_STATE().state().set_native_trace(func, context, mask);
+    return 0;
+}
+
 static int
 Extern_PyGreenlet_MAIN(PyGreenlet* self)
 {
@@ -970,6 +1281,11 @@ static PyMethodDef green_methods[] = {
      METH_VARARGS | METH_KEYWORDS,
      green_switch_doc},
     {"throw", (PyCFunction)green_throw, METH_VARARGS, green_throw_doc},
+    {"switch_threadsafe",
+     reinterpret_cast<PyCFunction>(green_switch_threadsafe),
+     METH_VARARGS | METH_KEYWORDS,
+     green_switch_threadsafe_doc},
+    {"throw_threadsafe", (PyCFunction)green_throw_threadsafe, METH_VARARGS, green_throw_threadsafe_doc},
     {"__getstate__", (PyCFunction)green_getstate, METH_NOARGS, NULL},
     {NULL, NULL} /* sentinel */
 };
@@ -986,6 +1302,10 @@ static PyGetSetDef green_getsets[] = {
      /*XXX*/ NULL},
     {"dead", (getter)green_getdead, NULL, /*XXX*/ NULL},
     {"_stack_saved", (getter)green_get_stack_saved, NULL, /*XXX*/ NULL},
+    {"gr_run_time", (getter)green_get_run_time, NULL, NULL},
+    {"gr_cpu_time", (getter)green_get_cpu_time, NULL, NULL},
+    {"gr_switches", (getter)green_get_switches, NULL, NULL},
+    {"gr_last_switch_in", (getter)green_get_last_switch_in, NULL, NULL},
     {NULL}
 };
 
@@ -1177,7 +1497,9 @@ PyDoc_STRVAR(mod_getcurrent_doc,
 static PyObject*
 mod_getcurrent(PyObject* UNUSED(module))
 {
-    return GET_THREAD_STATE().state().get_current().relinquish_ownership_o();
+    ThreadState& state = GET_THREAD_STATE();
+    ThreadState_Maintain(state);
+    return state.get_current().relinquish_ownership_o();
 }
 
 PyDoc_STRVAR(mod_settrace_doc,
@@ -1217,6 +1539,663 @@ mod_gettrace(PyObject* UNUSED(module))
     return tracefunc.relinquish_ownership();
 }
 
+PyDoc_STRVAR(mod_enumerate_doc,
+             "enumerate(thread=None, all_threads=False) -> list\n"
+             "\n"
+             "Return the greenlets of a thread that are running or suspended: its\n"
+             "main greenlet, and then every greenlet that has started and not\n"
+             "finished, oldest first. *thread* is the ident of the thread (as\n"
+             "returned by :func:`threading.get_ident`), or None for the current\n"
+             "thread; a thread that has never used greenlets has none. If\n"
+             "*all_threads* is true, return those of every thread instead.\n"
+             "\n"
+             "Each thread keeps a list of these greenlets, so this takes time\n"
+             "proportional to the number of greenlets returned, not to the size\n"
+             "of the heap.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_enumerate(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* const kwlist[] = {
+        "thread",
+        "all_threads",
+        NULL
+    };
+    PyObject* thread = Py_None;
+    int all_threads = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Op:enumerate",
+                                     (char**)kwlist, &thread, &all_threads)) {
+        return nullptr;
+    }
+    try {
+        // Collect references before making any objects, which could
+        // run code that changes the lists.
+        std::vector<OwnedGreenlet> greenlets;
+        if (all_threads) {
+            // Make sure we're included.
+            GET_THREAD_STATE().state();
+            ThreadState::get_all_live_greenlets(greenlets);
+        }
+        else if (thread == Py_None) {
+            GET_THREAD_STATE().state().get_live_greenlets(greenlets);
+        }
+        else {
+            const unsigned long thread_id = PyLong_AsUnsignedLong(thread);
+            if (thread_id == (unsigned long)-1 && PyErr_Occurred()) {
+                throw PyErrOccurred();
+            }
+            if (ThreadState* const state = ThreadState::find(thread_id)) {
+                state->get_live_greenlets(greenlets);
+            }
+        }
+        NewReference result(Require(PyList_New(greenlets.size())));
+        for (size_t i = 0; i < greenlets.size(); i++) {
+            PyList_SET_ITEM(result.borrow(), i, greenlets[i].relinquish_ownership_o());
+        }
+        return result.relinquish_ownership();
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+PyDoc_STRVAR(mod_dump_stacks_doc,
+             "dump_stacks() -> list\n"
+             "\n"
+             "Return the Python stacks of the greenlets suspended in the current\n"
+             "thread, as a list of ``(id(greenlet), frames)`` pairs in the order\n"
+             "of :func:`enumerate`. *frames* is a list of ``(filename, lineno,\n"
+             "name)`` tuples, outermost first, like :func:`traceback.extract_stack`\n"
+             "would give for the greenlet's ``gr_frame``. The running greenlet\n"
+             "isn't included.\n"
+             "\n"
+             "This reads the interpreter's frames directly: it doesn't create frame\n"
+             "objects for them, or do the work ``gr_frame`` does to make them\n"
+             "usable from Python, so it's suited to dumping many greenlets at once.\n"
+             "Other threads' greenlets can't be walked safely while those threads\n"
+             "run, so only the current thread is covered.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_dump_stacks(PyObject* UNUSED(module))
+{
+    try {
+        ThreadState& state = GET_THREAD_STATE().state();
+        std::vector<OwnedGreenlet> greenlets;
+        state.get_live_greenlets(greenlets);
+        // Collect all the frames before making any objects, which
+        // could run code that switches and changes them. Each
+        // greenlet's frames are a run in *frames*, innermost first,
+        // that ends at its entry in *ends*.
+        std::vector<PythonState::CodeLine> frames;
+        std::vector<std::pair<PyObject*, size_t> > ends;
+        for (size_t i = 0; i < greenlets.size(); i++) {
+            const Greenlet* const g = greenlets[i];
+            if (state.is_current(greenlets[i]) || !g->active()) {
+                continue;
+            }
+            g->collect_frames(frames);
+            ends.push_back(std::make_pair(greenlets[i].borrow_o(), frames.size()));
+        }
+
+        NewReference result(Require(PyList_New(ends.size())));
+        size_t start = 0;
+        for (size_t i = 0; i < ends.size(); i++) {
+            const size_t end = ends[i].second;
+            NewReference stack(Require(PyList_New(end - start)));
+            for (size_t j = start; j < end; j++) {
+                PyCodeObject* const code = reinterpret_cast<PyCodeObject*>(frames[j].first.borrow());
+                PyObject* const entry = Require(
+                    Py_BuildValue("(OiO)", code->co_filename, frames[j].second, code->co_name));
+                PyList_SET_ITEM(stack.borrow(), end - 1 - j, entry);
+            }
+            PyObject* const pair = Require(
+                Py_BuildValue("(NO)", PyLong_FromVoidPtr(ends[i].first), stack.borrow()));
+            PyList_SET_ITEM(result.borrow(), i, pair);
+            start = end;
+        }
+        return result.relinquish_ownership();
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+static PyObject*
+switch_stats_as_dict(const SwitchStats& stats)
+{
+    return Py_BuildValue(
+        "{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+        "switches", (unsigned long long)stats.switches,
+        "initial_stubs", (unsigned long long)stats.initial_stubs,
+        "throws", (unsigned long long)stats.throws,
+        "finished", (unsigned long long)stats.finished,
+        "stack_bytes_saved", (unsigned long long)stats.stack_bytes_saved,
+        "stack_bytes_restored", (unsigned long long)stats.stack_bytes_restored,
+        "stack_reallocs", (unsigned long long)stats.stack_reallocs,
+        "owner_walks", (unsigned long long)stats.owner_walks,
+        "owner_walk_steps", (unsigned long long)stats.owner_walk_steps,
+        "owner_walk_max", (unsigned long long)stats.owner_walk_max,
+        "deleteme_drains", (unsigned long long)stats.deleteme_drains,
+        "deleteme_greenlets", (unsigned long long)stats.deleteme_greenlets,
+        "frames_exposed", (unsigned long long)stats.frames_exposed);
+}
+
+PyDoc_STRVAR(mod_get_stats_doc,
+             "get_stats() -> dict\n"
+             "\n"
+             "Return the counters kept by the switching machinery. The result has\n"
+             "two dicts of counters, ``thread`` for the current thread and\n"
+             "``process`` for every thread there has been. Both have these keys:\n"
+             "\n"
+             "- ``switches``: completed stack switches. Of those,\n"
+             "  ``initial_stubs`` started a greenlet, ``throws`` delivered an\n"
+             "  exception, and ``finished`` left a greenlet whose ``run`` ended.\n"
+             "- ``stack_bytes_saved``, ``stack_bytes_restored``: C stack copied to\n"
+             "  and from the heap, and ``stack_reallocs``, how many times that\n"
+             "  needed a greenlet's heap copy to grow.\n"
+             "- ``owner_walks``, ``owner_walk_steps``, ``owner_walk_max``: how many\n"
+             "  times the chain of greenlets owning parts of the C stack was\n"
+             "  walked, how many links that followed in all, and the longest walk.\n"
+             "- ``deleteme_drains``, ``deleteme_greenlets``: how many times\n"
+             "  greenlets released in other threads were found waiting to be\n"
+             "  deleted, and how many there were.\n"
+             "- ``frames_exposed``: frames rewritten so a suspended greenlet's\n"
+             "  stack can be walked (Python 3.12 and later).\n"
+             "\n"
+             "``process`` also has ``threads``, the number of threads with greenlet\n"
+             "state, and ``stack_copy_bytes`` and ``stack_copy_bytes_peak``, the\n"
+             "total size of the heap copies of all suspended greenlets now and at\n"
+             "its highest.\n"
+             "\n"
+             "The counters are always kept; they are plain increments. See\n"
+             "``reset_stats()``.\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_get_stats(PyObject* UNUSED(module))
+{
+    try {
+        ThreadState& state = GET_THREAD_STATE();
+        SwitchStats process;
+        const size_t threads = ThreadState::add_process_stats(process);
+
+        NewReference thread_dict(Require(switch_stats_as_dict(state.stats())));
+        NewReference process_dict(Require(switch_stats_as_dict(process)));
+        const NewReference extra(Require(Py_BuildValue(
+            "{s:n,s:n,s:n}",
+            "threads", (Py_ssize_t)threads,
+            "stack_copy_bytes", (Py_ssize_t)StackState::total_stack_copy_bytes(),
+            "stack_copy_bytes_peak", (Py_ssize_t)StackState::peak_stack_copy_bytes())));
+        Require(PyDict_Update(process_dict.borrow(), extra.borrow()));
+        return Py_BuildValue("{s:O,s:O}",
+                             "thread", thread_dict.borrow(),
+                             "process", process_dict.borrow());
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+PyDoc_STRVAR(mod_reset_stats_doc,
+             "reset_stats() -> None\n"
+             "\n"
+             "Set every counter reported by ``get_stats()`` back to zero, in all\n"
+             "threads, and ``stack_copy_bytes_peak`` to the current\n"
+             "``stack_copy_bytes``.\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_reset_stats(PyObject* UNUSED(module))
+{
+    ThreadState::reset_process_stats();
+    StackState::reset_peak_stack_copy_bytes();
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_start_watchdog_doc,
+             "start_watchdog(threshold_ms, callback=None) -> None\n"
+             "\n"
+             "Start watching the current thread for greenlets that run for more\n"
+             "than *threshold_ms* milliseconds without switching, replacing any\n"
+             "previous watch on this thread.\n"
+             "\n"
+             "A native watchdog thread checks how many switches the thread has\n"
+             "made several times per threshold, without the GIL. When the count\n"
+             "hasn't changed for the threshold, it acquires the GIL and calls\n"
+             "``callback(greenlet, frame, seconds)`` with the greenlet that was\n"
+             "running, the frame the thread is executing (or None), and how long\n"
+             "it has gone without switching; that happens once per stall, in\n"
+             "the watchdog thread. If *callback* is None, that information and the\n"
+             "Python stack are printed to ``sys.stderr`` instead. Exceptions\n"
+             "raised by the callback are reported and ignored.\n"
+             "\n"
+             "A thread that is simply idle, for example waiting for I/O in its\n"
+             "event loop, doesn't switch either; the callback can ignore stalls\n"
+             "of the greenlet that does that.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_start_watchdog(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* const kwlist[] = {
+        "threshold_ms",
+        "callback",
+        NULL
+    };
+    double threshold_ms;
+    PyArgParseParam callback(Py_None);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "d|O:start_watchdog",
+                                     (char**)kwlist, &threshold_ms, &callback)) {
+        return nullptr;
+    }
+    if (!std::isfinite(threshold_ms)) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be finite");
+        return nullptr;
+    }
+    if (!(threshold_ms > 0)) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be positive");
+        return nullptr;
+    }
+    // Converting a larger one to integer nanoseconds is undefined.
+    if (!(threshold_ms < std::chrono::duration<double, std::milli>(
+              std::chrono::nanoseconds::max()).count())) {
+        PyErr_SetString(PyExc_ValueError, "threshold is too large");
+        return nullptr;
+    }
+    if (callback != Py_None && !PyCallable_Check(callback.borrow())) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable or None");
+        return nullptr;
+    }
+
+    ThreadState& state = GET_THREAD_STATE();
+    const std::shared_ptr<StallWatch> watch = std::make_shared<StallWatch>(
+        state.borrow_current(),
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double, std::milli>(threshold_ms)),
+        callback);
+    try {
+        mod_globs->watchdog->watch(watch);
+    }
+    catch (const PyErrOccurred&) {
+        watch->stop();
+        return nullptr;
+    }
+    state.set_stall_watch(watch);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_stop_watchdog_doc,
+             "stop_watchdog() -> None\n"
+             "\n"
+             "Stop watching the current thread.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_stop_watchdog(PyObject* UNUSED(module))
+{
+    GET_THREAD_STATE().state().set_stall_watch(nullptr);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_enable_accounting_doc,
+             "enable_accounting(enabled=True, cpu_time=False) -> None\n"
+             "\n"
+             "Start or stop keeping track, in each greenlet of the current thread,\n"
+             "of how long it has run (``gr_run_time``), how many times it has been\n"
+             "switched into (``gr_switches``) and when it last was\n"
+             "(``gr_last_switch_in``, a value of ``time.monotonic()``). If *cpu_time* is true, the thread's CPU\n"
+             "time is measured too (``gr_cpu_time``), which makes switches\n"
+             "noticeably more expensive on some platforms.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_enable_accounting(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* const kwlist[] = {
+        "enabled",
+        "cpu_time",
+        NULL
+    };
+    int enabled = 1;
+    int cpu_time = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pp:enable_accounting",
+                                     (char**)kwlist, &enabled, &cpu_time)) {
+        return nullptr;
+    }
+    GET_THREAD_STATE().state().set_accounting(enabled, cpu_time);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_start_switch_log_doc,
+             "start_switch_log(capacity) -> None\n"
+             "\n"
+             "Start recording every switch the current thread makes in a ring\n"
+             "buffer that holds *capacity* records, replacing (and discarding)\n"
+             "any buffer already in use. Recording costs no Python calls or\n"
+             "allocations; when the buffer is full, the oldest records are\n"
+             "overwritten. Read them with :func:`drain_switch_log`.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_start_switch_log(PyObject* UNUSED(module), PyObject* args)
+{
+    Py_ssize_t capacity;
+    if (!PyArg_ParseTuple(args, "n:start_switch_log", &capacity)) {
+        return nullptr;
+    }
+    if (capacity <= 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be positive");
+        return nullptr;
+    }
+    try {
+        GET_THREAD_STATE().state().set_switch_log(SwitchLog::create(capacity));
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_stop_switch_log_doc,
+             "stop_switch_log() -> None\n"
+             "\n"
+             "Stop recording the switches of the current thread, discarding any\n"
+             "records that haven't been drained.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_stop_switch_log(PyObject* UNUSED(module))
+{
+    GET_THREAD_STATE().state().set_switch_log(nullptr);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_drain_switch_log_doc,
+             "drain_switch_log([buffer]) -> bytes or int\n"
+             "\n"
+             "Remove the oldest records from the current thread's switch log.\n"
+             "Each is packed in the format ``SWITCH_LOG_FORMAT`` (see\n"
+             ":func:`struct.iter_unpack`): a sequence number, a\n"
+             "monotonic timestamp in nanoseconds, the ``id()`` of the origin and\n"
+             "target greenlets, the number of bytes of C stack the switch copied,\n"
+             "and the event (a key of ``SWITCH_LOG_EVENTS``). A gap in the\n"
+             "sequence numbers means records were overwritten.\n"
+             "\n"
+             "Without an argument, returns all the waiting records as bytes.\n"
+             "Otherwise, *buffer* must be writable (for example, a\n"
+             ":class:`mmap.mmap` or a slice of one); as many whole records\n"
+             "as fit are written to its start, and their number is returned.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_drain_switch_log(PyObject* UNUSED(module), PyObject* args)
+{
+    PyArgParseParam buffer;
+    if (!PyArg_ParseTuple(args, "|O:drain_switch_log", &buffer)) {
+        return nullptr;
+    }
+    SwitchLog* const log = GET_THREAD_STATE().state().borrow_switch_log();
+    if (!buffer) {
+        const size_t count = log ? log->available() : 0;
+        PyObject* result = PyBytes_FromStringAndSize(nullptr, count * sizeof(SwitchRecord));
+        if (result && count) {
+            log->drain(PyBytes_AS_STRING(result), count);
+        }
+        return result;
+    }
+
+    Py_buffer view;
+    if (PyObject_GetBuffer(buffer.borrow(), &view, PyBUF_WRITABLE) < 0) {
+        return nullptr;
+    }
+    const size_t count = log
+        ? log->drain(static_cast<char*>(view.buf), view.len / sizeof(SwitchRecord))
+        : 0;
+    PyBuffer_Release(&view);
+    return PyLong_FromSize_t(count);
+}
+
+PyDoc_STRVAR(mod_enable_switch_histograms_doc,
+             "enable_switch_histograms(enabled=True) -> None\n"
+             "\n"
+             "Start or stop timing the switches the current thread makes. Each\n"
+             "switch adds the time it took, and the time each phase of it took,\n"
+             "to a histogram; read them with :func:`get_switch_histograms`.\n"
+             "Stopping discards the histograms, and starting when already\n"
+             "started keeps them.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_enable_switch_histograms(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* const kwlist[] = {
+        "enabled",
+        NULL
+    };
+    int enabled = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p:enable_switch_histograms",
+                                     (char**)kwlist, &enabled)) {
+        return nullptr;
+    }
+    ThreadState& state = GET_THREAD_STATE();
+    if (!enabled) {
+        state.set_switch_timing(nullptr);
+    }
+    else if (!state.borrow_switch_timing()) {
+        state.set_switch_timing(new SwitchTiming());
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_get_switch_histograms_doc,
+             "get_switch_histograms(reset=False) -> dict or None\n"
+             "\n"
+             "Return the histograms of the current thread's switches, or None if\n"
+             "they aren't enabled (see :func:`enable_switch_histograms`). The keys\n"
+             "are ``total``, for whole switches, and the phases of a switch:\n"
+             "``capture``, saving the interpreter state; ``expose``, making the\n"
+             "frames of the greenlet being left walkable; ``save`` and\n"
+             "``restore``, copying the C stack to and from the heap; and\n"
+             "``trace``, calling trace functions, when there are any. Each value\n"
+             "is a list of counts, one for each bucket in\n"
+             "``SWITCH_HISTOGRAM_BOUNDS``. If *reset* is true, the counts are\n"
+             "set to zero afterwards.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_get_switch_histograms(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* const kwlist[] = {
+        "reset",
+        NULL
+    };
+    int reset = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p:get_switch_histograms",
+                                     (char**)kwlist, &reset)) {
+        return nullptr;
+    }
+    SwitchTiming* const timing = GET_THREAD_STATE().state().borrow_switch_timing();
+    if (!timing) {
+        Py_RETURN_NONE;
+    }
+    // Creating objects can run arbitrary code, which might stop the
+    // timing, so work from a copy.
+    LatencyHistogram histograms[SwitchTiming::PHASES];
+    for (int phase = 0; phase < SwitchTiming::PHASES; phase++) {
+        histograms[phase] = timing->histograms[phase];
+        if (reset) {
+            timing->histograms[phase] = LatencyHistogram();
+        }
+    }
+    try {
+        NewReference result(Require(PyDict_New()));
+        for (int phase = 0; phase < SwitchTiming::PHASES; phase++) {
+            const LatencyHistogram& histogram = histograms[phase];
+            NewReference counts(Require(PyList_New(LatencyHistogram::BUCKETS)));
+            for (unsigned int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+                PyList_SET_ITEM(counts.borrow(), i,
+                                Require(PyLong_FromUnsignedLongLong(histogram.counts[i])));
+            }
+            Require(PyDict_SetItemString(result.borrow(),
+                                         SwitchTiming::phase_names[phase],
+                                         counts.borrow()));
+        }
+        return result.relinquish_ownership();
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
+PyDoc_STRVAR(mod_run_pending_switches_doc,
+             "run_pending_switches() -> int\n"
+             "\n"
+             "Perform the switches that were queued for greenlets of the current\n"
+             "thread by :meth:`greenlet.switch_threadsafe` and\n"
+             ":meth:`greenlet.throw_threadsafe`, oldest first, and return how\n"
+             "many there were. Each is done from the calling greenlet, and\n"
+             "whatever is later switched back to it is discarded.\n"
+             "\n"
+             "If one of them raises an exception in the calling greenlet, that\n"
+             "exception propagates and the rest stay queued.\n"
+             "\n"
+             "First, it kills the greenlets of this thread that other threads\n"
+             "released, which otherwise waits for the thread's next switch or\n"
+             "call to :func:`getcurrent`.\n"
+             "\n"
+             "Greenlet never does this on its own: an event loop or scheduler\n"
+             "calls it when convenient.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_run_pending_switches(PyObject* UNUSED(module))
+{
+    ThreadState& state = GET_THREAD_STATE();
+    // We're about to switch anyway.
+    state.clear_deleteme_list();
+    Py_ssize_t count = 0;
+    while (PendingSwitch* const pending = state.take_pending_switch()) {
+        count++;
+        PyObject* const result = pending->is_throw
+            ? green_throw(pending->target.borrow(), pending->args.borrow())
+            : green_switch(pending->target.borrow(),
+                           pending->args.borrow(),
+                           pending->kwargs.borrow());
+        delete pending;
+        if (!result) {
+            return nullptr;
+        }
+        Py_DECREF(result);
+    }
+    return PyLong_FromSsize_t(count);
+}
+
+PyDoc_STRVAR(mod_set_switch_wakeup_doc,
+             "set_switch_wakeup(callback) -> object\n"
+             "\n"
+             "Sets a callable for the current thread and returns the previous\n"
+             "one (or None). When :meth:`greenlet.switch_threadsafe` or\n"
+             ":meth:`greenlet.throw_threadsafe` queue a switch for this thread and\n"
+             "none were already waiting, they call ``callback()`` (in the thread\n"
+             "that queued it) so that this thread knows to call\n"
+             ":func:`run_pending_switches`. In the main thread, it's also called\n"
+             "when another thread releases one of this thread's greenlets in the\n"
+             "middle of a switch, so it can't be killed right away;\n"
+             "``run_pending_switches()`` kills it. For example, it could write to a\n"
+             "pipe that this thread's event loop watches. Exceptions it raises\n"
+             "are reported and ignored. Pass None to remove it.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_set_switch_wakeup(PyObject* UNUSED(module), PyObject* callback)
+{
+    ThreadState& state = GET_THREAD_STATE();
+    OwnedObject previous = state.get_switch_wakeup();
+    if (!previous) {
+        previous = Py_None;
+    }
+
+    state.set_switch_wakeup(callback);
+
+    return previous.relinquish_ownership();
+}
+
+PyDoc_STRVAR(mod_run_in_thread_doc,
+             "run_in_thread(function, *args, **kwargs) -> object\n"
+             "\n"
+             "Call ``function(*args, **kwargs)`` in a worker thread, and return\n"
+             "what it returns (or raise what it raises). Meanwhile, switch to the\n"
+             "parent of the current greenlet, so other greenlets of this thread\n"
+             "can run.\n"
+             "\n"
+             "The outcome is delivered like :meth:`greenlet.switch_threadsafe`:\n"
+             "the current greenlet resumes when this thread next calls\n"
+             ":func:`run_pending_switches`. Nothing else should switch to it\n"
+             "until then.\n"
+             "\n"
+             "The workers are native threads shared by the whole process, and\n"
+             "are started as needed, up to ``min(32, os.cpu_count() + 4)``;\n"
+             "beyond that, calls wait their turn. This can't be used from a main\n"
+             "greenlet, or outside of the main interpreter.\n"
+             "\n"
+             "The workers don't survive :func:`os.fork`. In the child process, calls\n"
+             "that were queued or running raise :exc:`RuntimeError`, and new calls\n"
+             "start new workers.\n"
+             "\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_run_in_thread(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError,
+                        "run_in_thread() missing required argument 'function'");
+        return nullptr;
+    }
+    PyObject* const function = PyTuple_GET_ITEM(args, 0);
+    if (!PyCallable_Check(function)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "run_in_thread() argument 'function' must be callable");
+        return nullptr;
+    }
+
+    OwnedGreenlet parent;
+    try {
+        if (PyInterpreterState_Get() != PyInterpreterState_Main()) {
+            throw PyErrOccurred(mod_globs->PyExc_GreenletError,
+                                "run_in_thread() is only available in the main interpreter");
+        }
+        const BorrowedGreenlet current = GET_THREAD_STATE().state().borrow_current();
+        parent = current->parent();
+        if (!parent) {
+            throw PyErrOccurred(mod_globs->PyExc_GreenletError,
+                                "cannot run_in_thread() in a main greenlet");
+        }
+        const OwnedObject call_args = OwnedObject::consuming(
+            Require(PyTuple_GetSlice(args, 1, PY_SSIZE_T_MAX)));
+        mod_globs->thread_pool->submit(
+            new OffloadedCall(current, function, call_args, kwargs));
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+    return green_switch(parent.borrow(), mod_globs->empty_tuple, nullptr);
+}
+
 PyDoc_STRVAR(mod_set_thread_local_doc,
              "set_thread_local(key, value) -> None\n"
              "\n"
@@ -1255,6 +2234,97 @@ mod_get_pending_cleanup_count(PyObject* UNUSED(module))
     return PyLong_FromSize_t(mod_globs->thread_states_to_destroy.size());
 }
 
+PyDoc_STRVAR(mod_get_cleanup_stats_doc,
+             "get_cleanup_stats() -> dict\n"
+             "\n"
+             "Return statistics about destroying the greenlet state of threads\n"
+             "that have exited. This happens in passes, usually in the main thread.\n"
+             "The keys are:\n"
+             "\n"
+             "- ``pending``: thread states currently waiting to be destroyed.\n"
+             "- ``max_pending``: the most that were ever waiting at once.\n"
+             "- ``destroyed``: thread states destroyed so far.\n"
+             "- ``passes``: passes that destroyed at least one thread state.\n"
+             "- ``max_destroyed_per_pass``: the most destroyed by a single pass.\n"
+             "- ``total_time_ns``, ``max_pass_time_ns``: time spent in those passes.\n"
+             "- ``total_latency_ns``, ``max_latency_ns``: time from a thread\n"
+             "  state being queued to it being destroyed.\n"
+             "\n"
+             "This is an implementation specific, provisional API.\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_get_cleanup_stats(PyObject* UNUSED(module))
+{
+    size_t pending;
+    ThreadStateCleanup stats;
+    {
+        LockGuard cleanup_lock(*mod_globs->thread_states_to_destroy_lock);
+        const ThreadStateCleanup& cleanup = mod_globs->cleanup();
+        pending = mod_globs->thread_states_to_destroy.size();
+        stats.max_queued = cleanup.max_queued;
+        stats.destroyed = cleanup.destroyed;
+        stats.passes = cleanup.passes;
+        stats.max_destroyed_per_pass = cleanup.max_destroyed_per_pass;
+        stats.total_time = cleanup.total_time;
+        stats.max_pass_time = cleanup.max_pass_time;
+        stats.total_latency = cleanup.total_latency;
+        stats.max_latency = cleanup.max_latency;
+    }
+    return Py_BuildValue(
+        "{s:n,s:n,s:n,s:n,s:n,s:L,s:L,s:L,s:L}",
+        "pending", (Py_ssize_t)pending,
+        "max_pending", (Py_ssize_t)stats.max_queued,
+        "destroyed", (Py_ssize_t)stats.destroyed,
+        "passes", (Py_ssize_t)stats.passes,
+        "max_destroyed_per_pass", (Py_ssize_t)stats.max_destroyed_per_pass,
+        "total_time_ns", (long long)stats.total_time.count(),
+        "max_pass_time_ns", (long long)stats.max_pass_time.count(),
+        "total_latency_ns", (long long)stats.total_latency.count(),
+        "max_latency_ns", (long long)stats.max_latency.count());
+}
+
+PyDoc_STRVAR(mod_set_cleanup_budget_doc,
+             "set_cleanup_budget(max_count=0, max_usec=0) -> None\n"
+             "\n"
+             "Limit how much work a single pass destroying the greenlet state of\n"
+             "exited threads does (see ``get_cleanup_stats()``), so that many\n"
+             "threads exiting at once don't stall whatever thread runs that pass.\n"
+             "A pass stops after destroying *max_count* thread states or after\n"
+             "*max_usec* microseconds, whichever comes first; it always destroys\n"
+             "at least one. Zero (the default) means no limit. Whatever is left\n"
+             "over is destroyed by the next pass, which runs the next time\n"
+             "any thread switches greenlets or another thread exits.\n"
+             "\n"
+             "This is an implementation specific, provisional API.\n"
+             ".. versionadded:: 3.0.4\n");
+
+static PyObject*
+mod_set_cleanup_budget(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    static const char* const kwlist[] = {
+        "max_count",
+        "max_usec",
+        NULL
+    };
+    Py_ssize_t max_count = 0;
+    Py_ssize_t max_usec = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|nn:set_cleanup_budget",
+                                     (char**)kwlist, &max_count, &max_usec)) {
+        return nullptr;
+    }
+    if (max_count < 0 || max_usec < 0) {
+        PyErr_SetString(PyExc_ValueError, "budget must not be negative");
+        return nullptr;
+    }
+
+    LockGuard cleanup_lock(*mod_globs->thread_states_to_destroy_lock);
+    ThreadStateCleanup& cleanup = mod_globs->cleanup();
+    cleanup.max_per_pass = max_count;
+    cleanup.max_time_per_pass = std::chrono::microseconds(max_usec);
+    Py_RETURN_NONE;
+}
+
 PyDoc_STRVAR(mod_get_total_main_greenlets_doc,
              "get_total_main_greenlets() -> Integer\n"
              "\n"
@@ -1286,19 +2356,25 @@ PyDoc_STRVAR(mod_get_clocks_used_doing_optional_cleanup_doc,
              "\n"
              "This is an implementation specific, provisional API. It may be changed or removed\n"
              "in the future.\n"
-             ".. versionadded:: 2.0"
+             ".. versionadded:: 2.0\n"
+             ".. deprecated:: 3.0.4\n"
+             "   greenlet no longer does any optional cleanup (greenlets left\n"
+             "   to be killed in an exiting thread are killed as it exits),\n"
+             "   so this always returns 0, or None if cleanup was disabled.\n"
+             "   It will be removed in a future release."
              );
+
+// All that's left of the optional cleanup. See
+// mod_enable_optional_cleanup().
+static bool optional_cleanup_enabled = true;
+
 static PyObject*
 mod_get_clocks_used_doing_optional_cleanup(PyObject* UNUSED(module))
 {
-    std::clock_t& clocks = ThreadState::clocks_used_doing_gc();
-
-    if (clocks == std::clock_t(-1)) {
+    if (!optional_cleanup_enabled) {
         Py_RETURN_NONE;
     }
-    // This might not actually work on some implementations; clock_t
-    // is an opaque type.
-    return PyLong_FromSsize_t(clocks);
+    return PyLong_FromLong(0);
 }
 
 PyDoc_STRVAR(mod_enable_optional_cleanup_doc,
@@ -1306,6 +2382,10 @@ PyDoc_STRVAR(mod_enable_optional_cleanup_doc,
              "\n"
              "Enable or disable optional cleanup operations.\n"
              "See ``get_clocks_used_doing_optional_cleanup()`` for details.\n"
+             ".. deprecated:: 3.0.4\n"
+             "   There are no optional cleanup operations anymore; this only\n"
+             "   changes whether ``get_clocks_used_doing_optional_cleanup()``\n"
+             "   returns None. It will be removed in a future release.\n"
              );
 static PyObject*
 mod_enable_optional_cleanup(PyObject* UNUSED(module), PyObject* flag)
@@ -1315,16 +2395,7 @@ mod_enable_optional_cleanup(PyObject* UNUSED(module), PyObject* flag)
         return nullptr;
     }
 
-    std::clock_t& clocks = ThreadState::clocks_used_doing_gc();
-    if (is_true) {
-        // If we already have a value, we don't want to lose it.
-        if (clocks == std::clock_t(-1)) {
-            clocks = 0;
-        }
-    }
-    else {
-        clocks = std::clock_t(-1);
-    }
+    optional_cleanup_enabled = is_true;
     Py_RETURN_NONE;
 }
 
@@ -1344,6 +2415,20 @@ mod_get_tstate_trash_delete_nesting(PyObject* UNUSED(module))
 #endif
 }
 
+#ifndef NDEBUG
+PyDoc_STRVAR(mod_get_refcount_operations_doc,
+             "get_refcount_operations() -> Integer\n"
+             "\n"
+             "Return the number of reference count changes made by greenlet's\n"
+             "internal reference classes so far. Debug builds only; testing only.\n");
+
+static PyObject*
+mod_get_refcount_operations(PyObject* UNUSED(module))
+{
+    return PyLong_FromSsize_t(greenlet::refs::refcount_operations);
+}
+#endif
+
 static PyMethodDef GreenMethods[] = {
     {"getcurrent",
      (PyCFunction)mod_getcurrent,
@@ -1351,12 +2436,32 @@ static PyMethodDef GreenMethods[] = {
      mod_getcurrent_doc},
     {"settrace", (PyCFunction)mod_settrace, METH_VARARGS, mod_settrace_doc},
     {"gettrace", (PyCFunction)mod_gettrace, METH_NOARGS, mod_gettrace_doc},
+    {"run_pending_switches", (PyCFunction)mod_run_pending_switches, METH_NOARGS, mod_run_pending_switches_doc},
+    {"set_switch_wakeup", (PyCFunction)mod_set_switch_wakeup, METH_O, mod_set_switch_wakeup_doc},
+    {"enumerate", reinterpret_cast<PyCFunction>(mod_enumerate), METH_VARARGS | METH_KEYWORDS, mod_enumerate_doc},
+    {"dump_stacks", (PyCFunction)mod_dump_stacks, METH_NOARGS, mod_dump_stacks_doc},
+    {"get_stats", (PyCFunction)mod_get_stats, METH_NOARGS, mod_get_stats_doc},
+    {"reset_stats", (PyCFunction)mod_reset_stats, METH_NOARGS, mod_reset_stats_doc},
+    {"start_watchdog", reinterpret_cast<PyCFunction>(mod_start_watchdog), METH_VARARGS | METH_KEYWORDS, mod_start_watchdog_doc},
+    {"stop_watchdog", (PyCFunction)mod_stop_watchdog, METH_NOARGS, mod_stop_watchdog_doc},
+    {"enable_accounting", reinterpret_cast<PyCFunction>(mod_enable_accounting), METH_VARARGS | METH_KEYWORDS, mod_enable_accounting_doc},
+    {"start_switch_log", (PyCFunction)mod_start_switch_log, METH_VARARGS, mod_start_switch_log_doc},
+    {"stop_switch_log", (PyCFunction)mod_stop_switch_log, METH_NOARGS, mod_stop_switch_log_doc},
+    {"drain_switch_log", (PyCFunction)mod_drain_switch_log, METH_VARARGS, mod_drain_switch_log_doc},
+    {"enable_switch_histograms", reinterpret_cast<PyCFunction>(mod_enable_switch_histograms), METH_VARARGS | METH_KEYWORDS, mod_enable_switch_histograms_doc},
+    {"get_switch_histograms", reinterpret_cast<PyCFunction>(mod_get_switch_histograms), METH_VARARGS | METH_KEYWORDS, mod_get_switch_histograms_doc},
+    {"run_in_thread", reinterpret_cast<PyCFunction>(mod_run_in_thread), METH_VARARGS | METH_KEYWORDS, mod_run_in_thread_doc},
     {"set_thread_local", (PyCFunction)mod_set_thread_local, METH_VARARGS, mod_set_thread_local_doc},
     {"get_pending_cleanup_count", (PyCFunction)mod_get_pending_cleanup_count, METH_NOARGS, mod_get_pending_cleanup_count_doc},
     {"get_total_main_greenlets", (PyCFunction)mod_get_total_main_greenlets, METH_NOARGS, mod_get_total_main_greenlets_doc},
+    {"get_cleanup_stats", (PyCFunction)mod_get_cleanup_stats, METH_NOARGS, mod_get_cleanup_stats_doc},
+    {"set_cleanup_budget", reinterpret_cast<PyCFunction>(mod_set_cleanup_budget), METH_VARARGS | METH_KEYWORDS, mod_set_cleanup_budget_doc},
     {"get_clocks_used_doing_optional_cleanup", (PyCFunction)mod_get_clocks_used_doing_optional_cleanup, METH_NOARGS, mod_get_clocks_used_doing_optional_cleanup_doc},
     {"enable_optional_cleanup", (PyCFunction)mod_enable_optional_cleanup, METH_O, mod_enable_optional_cleanup_doc},
     {"get_tstate_trash_delete_nesting", (PyCFunction)mod_get_tstate_trash_delete_nesting, METH_NOARGS, mod_get_tstate_trash_delete_nesting_doc},
+#ifndef NDEBUG
+    {"get_refcount_operations", (PyCFunction)mod_get_refcount_operations, METH_NOARGS, mod_get_refcount_operations_doc},
+#endif
     {NULL, NULL} /* Sentinel */
 };
 
@@ -1369,29 +2474,84 @@ static const char* const copy_on_greentype[] = {
     NULL
 };
 
+static int greenlet_internal_mod_exec(PyObject* module) noexcept;
+
+// Our native threads don't survive a fork; ``os.register_at_fork()``
+// calls this in the child, holding the GIL, to forget them.
+static PyObject*
+mod_after_fork_in_child(PyObject* UNUSED(module), PyObject* UNUSED(args))
+{
+    mod_globs->thread_pool->after_fork_in_child();
+    mod_globs->watchdog->after_fork_in_child();
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef after_fork_in_child_def = {
+    "_after_fork_in_child",
+    (PyCFunction)mod_after_fork_in_child,
+    METH_NOARGS,
+    NULL
+};
+
+static void
+register_at_fork()
+{
+    const NewReference os(Require(PyImport_ImportModule("os")));
+    if (!PyObject_HasAttrString(os.borrow(), "register_at_fork")) {
+        // No fork() on this platform.
+        return;
+    }
+    const NewReference register_func(Require(PyObject_GetAttrString(os.borrow(), "register_at_fork")));
+    const NewReference hook(Require(PyCFunction_New(&after_fork_in_child_def, NULL)));
+    const NewReference register_kwargs(Require(Py_BuildValue("{s:O}", "after_in_child", hook.borrow())));
+    const NewReference registered(Require(PyObject_Call(register_func.borrow(),
+                                                        mod_globs->empty_tuple.borrow(),
+                                                        register_kwargs.borrow())));
+}
+
+static PyModuleDef_Slot greenlet_module_slots[] = {
+    {Py_mod_exec, (void*)greenlet_internal_mod_exec},
+#ifdef Py_mod_multiple_interpreters
+    // Our types, our globals and, worse, the ThreadState of each OS
+    // thread are shared by every interpreter, so a greenlet of one
+    // interpreter could be switched to from another. Like the
+    // single-phase module we used to be, we can be imported by legacy
+    // subinterpreters, but not by those that check their extensions.
+    {Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_NOT_SUPPORTED},
+#endif
+    {0, NULL}
+};
+
 static struct PyModuleDef greenlet_module_def = {
     PyModuleDef_HEAD_INIT,
     "greenlet._greenlet",
     NULL,
-    -1,
+    0,
     GreenMethods,
+    greenlet_module_slots,
 };
 
 
 
-static PyObject*
-greenlet_internal_mod_init() noexcept
+static int
+greenlet_internal_mod_exec(PyObject* module) noexcept
 {
     static void* _PyGreenlet_API[PyGreenlet_API_pointers];
 
     try {
-        CreatedModule m(greenlet_module_def);
-
-        Require(PyType_Ready(&PyGreenlet_Type));
-        Require(PyType_Ready(&PyGreenletUnswitchable_Type));
-
-        mod_globs = new greenlet::GreenletGlobals;
-        ThreadState::init();
+        CreatedModule m(module);
+        // Every interpreter that imports us gets its own module
+        // object, but the types, the globals and the C API they
+        // describe are process-wide and only set up once.
+        const bool first_exec = !mod_globs;
+
+        if (first_exec) {
+            Require(PyType_Ready(&PyGreenlet_Type));
+            Require(PyType_Ready(&PyGreenletUnswitchable_Type));
+
+            mod_globs = new greenlet::GreenletGlobals;
+            register_at_fork();
+        }
 
         m.PyAddObject("greenlet", PyGreenlet_Type);
         m.PyAddObject("UnswitchableGreenlet", PyGreenletUnswitchable_Type);
@@ -1406,14 +2566,32 @@ greenlet_internal_mod_init() noexcept
         OwnedObject clocks_per_sec = OwnedObject::consuming(PyLong_FromSsize_t(CLOCKS_PER_SEC));
         m.PyAddObject("CLOCKS_PER_SEC", clocks_per_sec);
 
+        const NewReference log_format(Require(PyUnicode_FromString(SwitchLog::format)));
+        m.PyAddObject("SWITCH_LOG_FORMAT", log_format);
+        const NewReference log_events(Require(Py_BuildValue(
+            "{i:s,i:s,i:s,i:s}",
+            PyGreenlet_TRACE_SWITCH, "switch",
+            PyGreenlet_TRACE_THROW, "throw",
+            PyGreenlet_TRACE_START, "start",
+            PyGreenlet_TRACE_FINISH, "finish")));
+        m.PyAddObject("SWITCH_LOG_EVENTS", log_events);
+        const NewReference histogram_bounds(Require(PyTuple_New(LatencyHistogram::BUCKETS)));
+        for (unsigned int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+            PyTuple_SET_ITEM(histogram_bounds.borrow(), i,
+                             Require(PyLong_FromUnsignedLongLong(LatencyHistogram::lower_bound(i))));
+        }
+        m.PyAddObject("SWITCH_HISTOGRAM_BOUNDS", histogram_bounds);
+
         /* also publish module-level data as attributes of the greentype. */
         // XXX: This is weird, and enables a strange pattern of
         // confusing the class greenlet with the module greenlet; with
         // the exception of (possibly) ``getcurrent()``, this
         // shouldn't be encouraged so don't add new items here.
-        for (const char* const* p = copy_on_greentype; *p; p++) {
-            OwnedObject o = m.PyRequireAttr(*p);
-            PyDict_SetItemString(PyGreenlet_Type.tp_dict, *p, o.borrow());
+        if (first_exec) {
+            for (const char* const* p = copy_on_greentype; *p; p++) {
+                OwnedObject o = m.PyRequireAttr(*p);
+                PyDict_SetItemString(PyGreenlet_Type.tp_dict, *p, o.borrow());
+            }
         }
 
         /*
@@ -1439,6 +2617,10 @@ greenlet_internal_mod_init() noexcept
         _PyGreenlet_API[PyGreenlet_STARTED_NUM] = (void*)Extern_PyGreenlet_STARTED;
         _PyGreenlet_API[PyGreenlet_ACTIVE_NUM] = (void*)Extern_PyGreenlet_ACTIVE;
         _PyGreenlet_API[PyGreenlet_GET_PARENT_NUM] = (void*)Extern_PyGreenlet_GET_PARENT;
+        _PyGreenlet_API[PyGreenlet_SwitchThreadsafe_NUM] = (void*)PyGreenlet_SwitchThreadsafe;
+        _PyGreenlet_API[PyGreenlet_ThrowThreadsafe_NUM] = (void*)PyGreenlet_ThrowThreadsafe;
+        _PyGreenlet_API[PyGreenlet_GetCurrentBorrowed_NUM] = (void*)PyGreenlet_GetCurrentBorrowed;
+        _PyGreenlet_API[PyGreenlet_SetNativeTrace_NUM] = (void*)PyGreenlet_SetNativeTrace;
 
         /* XXX: Note that our module name is ``greenlet._greenlet``, but for
            backwards compatibility with existing C code, we need the _C_API to
@@ -1465,14 +2647,14 @@ greenlet_internal_mod_init() noexcept
         //      << "\n\tPyGreenlet     : " << sizeof(PyGreenlet)
         //      << endl;
 
-        return m.borrow(); // But really it's the main reference.
+        return 0;
     }
     catch (const LockInitError& e) {
         PyErr_SetString(PyExc_MemoryError, e.what());
-        return NULL;
+        return -1;
     }
     catch (const PyErrOccurred&) {
-        return NULL;
+        return -1;
     }
 
 }
@@ -1482,7 +2664,7 @@ extern "C" {
 PyMODINIT_FUNC
 PyInit__greenlet(void)
 {
-    return greenlet_internal_mod_init();
+    return PyModuleDef_Init(&greenlet_module_def);
 }
 
 }; // extern C
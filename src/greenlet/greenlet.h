@@ -28,11 +28,29 @@ typedef struct _greenlet {
 
 #define PyGreenlet_Check(op) (op && PyObject_TypeCheck(op, &PyGreenlet_Type))
 
+/* Events reported to native trace functions. */
+#define PyGreenlet_TRACE_SWITCH 0x1
+#define PyGreenlet_TRACE_THROW 0x2
+#define PyGreenlet_TRACE_START 0x4
+#define PyGreenlet_TRACE_FINISH 0x8
+#define PyGreenlet_TRACE_ALL 0xf
+
+/*
+ * A native trace function, called with the GIL held just after
+ * *target* starts running. It must not run Python code, switch, or
+ * disturb the exception state (an exception is set for
+ * PyGreenlet_TRACE_THROW).
+ */
+typedef void (*PyGreenlet_TraceFunc)(int event,
+                                     PyGreenlet* origin,
+                                     PyGreenlet* target,
+                                     void* context);
+
 
 /* C API functions */
 
 /* Total number of symbols that are exported */
-#define PyGreenlet_API_pointers 12
+#define PyGreenlet_API_pointers 16
 
 #define PyGreenlet_Type_NUM 0
 #define PyExc_GreenletError_NUM 1
@@ -49,6 +67,11 @@ typedef struct _greenlet {
 #define PyGreenlet_ACTIVE_NUM 10
 #define PyGreenlet_GET_PARENT_NUM 11
 
+#define PyGreenlet_SwitchThreadsafe_NUM 12
+#define PyGreenlet_ThrowThreadsafe_NUM 13
+#define PyGreenlet_GetCurrentBorrowed_NUM 14
+#define PyGreenlet_SetNativeTrace_NUM 15
+
 #ifndef GREENLET_MODULE
 /* This section is used by modules that uses the greenlet C API */
 static void** _PyGreenlet_API = NULL;
@@ -79,6 +102,15 @@ static void** _PyGreenlet_API = NULL;
 #    define PyGreenlet_GetCurrent \
         (*(PyGreenlet * (*)(void)) _PyGreenlet_API[PyGreenlet_GetCurrent_NUM])
 
+/*
+ * PyGreenlet_GetCurrentBorrowed(void)
+ *
+ * greenlet.getcurrent(), as a borrowed reference. It remains valid at
+ * least until the current greenlet switches.
+ */
+#    define PyGreenlet_GetCurrentBorrowed \
+        (*(PyGreenlet * (*)(void)) _PyGreenlet_API[PyGreenlet_GetCurrentBorrowed_NUM])
+
 /*
  * PyGreenlet_Throw(
  *         PyGreenlet *greenlet,
@@ -144,6 +176,46 @@ static void** _PyGreenlet_API = NULL;
     (*(int (*)(PyGreenlet*))                                         \
      _PyGreenlet_API[PyGreenlet_ACTIVE_NUM])
 
+/*
+ * PyGreenlet_SwitchThreadsafe(PyGreenlet *greenlet, PyObject *args, PyObject *kwargs)
+ *
+ * g.switch_threadsafe(*args, **kwargs); returns 0, or -1 with an
+ * exception set.
+ */
+#    define PyGreenlet_SwitchThreadsafe                                    \
+        (*(int (*)(PyGreenlet * greenlet, PyObject * args, PyObject * kwargs)) \
+             _PyGreenlet_API[PyGreenlet_SwitchThreadsafe_NUM])
+
+/*
+ * PyGreenlet_ThrowThreadsafe(
+ *         PyGreenlet *greenlet,
+ *         PyObject *typ,
+ *         PyObject *val,
+ *         PyObject *tb)
+ *
+ * g.throw_threadsafe(...); returns 0, or -1 with an exception set.
+ */
+#    define PyGreenlet_ThrowThreadsafe       \
+        (*(int (*)(PyGreenlet * self,        \
+                   PyObject * typ,           \
+                   PyObject * val,           \
+                   PyObject * tb))           \
+             _PyGreenlet_API[PyGreenlet_ThrowThreadsafe_NUM])
+
+/*
+ * PyGreenlet_SetNativeTrace(PyGreenlet_TraceFunc func, void* context, int mask)
+ *
+ * Like greenlet.settrace(), for the current thread, but for a C
+ * function that is only told about the events in *mask* (some of
+ * the PyGreenlet_TRACE_* flags). Pass NULL to remove it. Returns 0,
+ * or -1 with an exception set.
+ */
+#    define PyGreenlet_SetNativeTrace                           \
+        (*(int (*)(PyGreenlet_TraceFunc func,                   \
+                   void* context,                               \
+                   int mask))                                   \
+             _PyGreenlet_API[PyGreenlet_SetNativeTrace_NUM])
+
 
 
 
@@ -0,0 +1,28 @@
+#ifndef GREENLET_CLOCK_HPP
+#define GREENLET_CLOCK_HPP
+
+/**
+ * The clock behind the timestamps and durations that greenlet
+ * reports: switch logs, switch histograms and accounting.
+ */
+
+#include <chrono>
+#include <cstdint>
+
+namespace greenlet {
+
+/**
+ * The time of ``std::chrono::steady_clock``, in nanoseconds since its
+ * epoch. That's the clock of ``time.monotonic()`` on Linux, but not
+ * everywhere, so only differences of it are worth reporting.
+ */
+static inline uint64_t
+steady_clock_ns() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}; // namespace greenlet
+
+#endif
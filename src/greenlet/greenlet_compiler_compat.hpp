@@ -91,5 +91,19 @@
 #    define G_NOEXCEPT_WIN32
 #endif
 
+// Thread-local variables in a shared library normally use the
+// general-dynamic TLS model, which means calling __tls_get_addr on
+// every access. glibc reserves a little static TLS space for
+// libraries loaded with dlopen, enough for a pointer or two to use
+// the initial-exec model instead, which is just an offset from the
+// thread pointer. Only use this for small variables. Define
+// GREENLET_NO_INITIAL_EXEC_TLS when building to turn it off.
+#if defined(__GNUC__) && defined(__ELF__) && defined(__GLIBC__) \
+    && !defined(GREENLET_NO_INITIAL_EXEC_TLS)
+#    define G_TLS_INITIAL_EXEC __attribute__((tls_model("initial-exec")))
+#else
+#    define G_TLS_INITIAL_EXEC
+#endif
+
 
 #endif
@@ -95,6 +95,12 @@ https://bugs.python.org/issue39573 */
 #    define PyObject_GC_IsTracked(o) _PyObject_GC_IS_TRACKED(o)
 #endif
 
+#if PY_VERSION_HEX < 0x03090000
+// The official version only became available in 3.9; before that,
+// this is what it did.
+#    define PyInterpreterState_Get() (PyThreadState_Get()->interp)
+#endif
+
 
 // bpo-43760 added PyThreadState_EnterTracing() to Python 3.11.0a2
 #if PY_VERSION_HEX < 0x030B00A2 && !defined(PYPY_VERSION)
@@ -7,6 +7,10 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
 #include "greenlet_compiler_compat.hpp"
 #include "greenlet_refs.hpp"
 #include "greenlet_cpython_compat.hpp"
@@ -22,8 +26,10 @@ using greenlet::refs::BorrowedGreenlet;
 #  define _PyInterpreterFrame _interpreter_frame
 #endif
 
-#if GREENLET_PY312
+#if GREENLET_PY311
 #  include "internal/pycore_frame.h"
+#else
+#  include "frameobject.h"
 #endif
 
 // XXX: TODO: Work to remove all virtual functions
@@ -88,6 +94,17 @@ namespace greenlet
         }
     };
     class SwitchingArgs;
+    class StackState;
+    // The parts of the PyThreadState that belong to a greenlet, saved
+    // when it switches away and restored when it switches back.
+    //
+    // We copy these fields individually instead of giving each
+    // greenlet its own PyThreadState and using PyThreadState_Swap:
+    // swapping thread states costs about as much as an entire
+    // greenlet switch, on 3.12+ it also releases and re-acquires the
+    // GIL, and it would split per-thread data (threading.local,
+    // sys.settrace, ...) between greenlets of the same thread. See
+    // benchmarks/tstate_swap.py.
     class PythonState : public PythonStateContext
     {
     public:
@@ -128,6 +145,26 @@ namespace greenlet
         // interpreter detail; they're not needed for introspection, but do
         // need to be present for the eval loop to work.
         void unexpose_frames();
+#if GREENLET_PY312
+        // Only a few complete frames actually have their ``previous``
+        // pointer rewritten when we expose: those that were entered
+        // from C. These "boundary" frames form a list, threaded
+        // through storage in their frame objects, that starts here
+        // and that ``unexpose_frames`` walks to undo the rewrites.
+        _PyInterpreterFrame* exposed_boundaries;
+        // The innermost frame owned by the thread that we exposed the
+        // last time we were suspended, its frame object, and the
+        // portion of the boundary list at or below it. As long as
+        // that frame hasn't returned, nothing below it can have
+        // changed, so the next time we're suspended we only need to
+        // walk down to it and can then re-apply the old rewrites.
+        // The frame object is borrowed; see is_watermark().
+        _PyInterpreterFrame* watermark_iframe;
+        PyFrameObject* watermark_frame_obj;
+        _PyInterpreterFrame* watermark_boundaries;
+        inline bool is_watermark(const _PyInterpreterFrame* iframe) const noexcept;
+        inline void reset_watermark() noexcept;
+#endif
 
     public:
 
@@ -150,6 +187,75 @@ namespace greenlet
         inline void may_switch_away() noexcept;
         inline void will_switch_from(PyThreadState *const origin_tstate) noexcept;
         void did_finish(PyThreadState* tstate) noexcept;
+        // See Greenlet::expose_frames(); *stack_state* is the stack
+        // of the greenlet this object belongs to. Returns how many
+        // frames were rewritten.
+        unsigned int expose_frames(const StackState& stack_state);
+
+        // A code object and the line it's executing.
+        typedef std::pair<OwnedObject, int> CodeLine;
+        // Append one of these for each of our frames, innermost
+        // first, to *frames*. This doesn't create frame objects,
+        // expose frames, or run any Python code. We must be
+        // suspended; *stack_state* is the stack of our greenlet.
+        void collect_frames(const StackState& stack_state,
+                            std::vector<CodeLine>& frames) const;
+    };
+
+    // Counters kept by each thread for ``greenlet.get_stats()``.
+    // They're only changed and read with the GIL held, so they're
+    // plain integers.
+    struct SwitchStats
+    {
+        // Completed stack switches; those that started a greenlet,
+        // delivered an exception, or left a greenlet that had
+        // finished.
+        uint64_t switches = 0;
+        uint64_t initial_stubs = 0;
+        uint64_t throws = 0;
+        uint64_t finished = 0;
+        // Bytes of C stack copied to and from the heap, and how many
+        // times a greenlet's heap copy had to grow.
+        uint64_t stack_bytes_saved = 0;
+        uint64_t stack_bytes_restored = 0;
+        uint64_t stack_reallocs = 0;
+        // Walks of the chain of greenlets that own parts of the C
+        // stack, how many links they followed, and the longest.
+        uint64_t owner_walks = 0;
+        uint64_t owner_walk_steps = 0;
+        uint64_t owner_walk_max = 0;
+        // Times the list of greenlets to delete was found non-empty,
+        // and how many greenlets were on it.
+        uint64_t deleteme_drains = 0;
+        uint64_t deleteme_greenlets = 0;
+        // Frames whose link to their caller was rewritten so that a
+        // suspended greenlet's stack can be walked (Python 3.12+).
+        uint64_t frames_exposed = 0;
+
+        inline void owner_walk(uint64_t steps) noexcept
+        {
+            this->owner_walks++;
+            this->owner_walk_steps += steps;
+            this->owner_walk_max = std::max(this->owner_walk_max, steps);
+        }
+
+        SwitchStats& operator+=(const SwitchStats& other) noexcept
+        {
+            this->switches += other.switches;
+            this->initial_stubs += other.initial_stubs;
+            this->throws += other.throws;
+            this->finished += other.finished;
+            this->stack_bytes_saved += other.stack_bytes_saved;
+            this->stack_bytes_restored += other.stack_bytes_restored;
+            this->stack_reallocs += other.stack_reallocs;
+            this->owner_walks += other.owner_walks;
+            this->owner_walk_steps += other.owner_walk_steps;
+            this->owner_walk_max = std::max(this->owner_walk_max, other.owner_walk_max);
+            this->deleteme_drains += other.deleteme_drains;
+            this->deleteme_greenlets += other.deleteme_greenlets;
+            this->frames_exposed += other.frames_exposed;
+            return *this;
+        }
     };
 
     class StackState
@@ -167,7 +273,14 @@ namespace greenlet
         char* stack_copy;
         intptr_t _stack_saved;
         StackState* stack_prev;
-        inline int copy_stack_to_heap_up_to(const char* const stop) noexcept;
+        // The total size of every stack_copy in the process, and the
+        // most it has been. Protected by the GIL.
+        static intptr_t total_stack_copy;
+        static intptr_t peak_stack_copy;
+        // These return the number of bytes copied, or -1 with an
+        // exception set.
+        inline intptr_t copy_stack_to_heap_up_to(const char* const stop,
+                                                 SwitchStats& stats) noexcept;
         inline void free_stack_copy() noexcept;
 
     public:
@@ -183,8 +296,12 @@ namespace greenlet
         ~StackState();
         StackState(const StackState& other);
         StackState& operator=(const StackState& other);
-        inline void copy_heap_to_stack(const StackState& current) noexcept;
-        inline int copy_stack_to_heap(char* const stackref, const StackState& current) noexcept;
+        inline void copy_heap_to_stack(const StackState& current, SwitchStats& stats) noexcept;
+        inline intptr_t copy_stack_to_heap(char* const stackref, const StackState& current,
+                                           SwitchStats& stats) noexcept;
+        inline static intptr_t total_stack_copy_bytes() noexcept;
+        inline static intptr_t peak_stack_copy_bytes() noexcept;
+        inline static void reset_peak_stack_copy_bytes() noexcept;
         inline bool started() const noexcept;
         inline bool main() const noexcept;
         inline bool active() const noexcept;
@@ -227,6 +344,11 @@ namespace greenlet
               _kwargs(kwargs)
         {}
 
+        SwitchingArgs(OwnedObject&& args, OwnedObject&& kwargs)
+            : _args(std::move(args)),
+              _kwargs(std::move(kwargs))
+        {}
+
         SwitchingArgs(const SwitchingArgs& other)
             : _args(other._args),
               _kwargs(other._kwargs)
@@ -248,13 +370,21 @@ namespace greenlet
         SwitchingArgs& operator<<=(SwitchingArgs& other)
         {
             if (this != &other) {
-                this->_args = other._args;
-                this->_kwargs = other._kwargs;
-                other.CLEAR();
+                this->_args = std::move(other._args);
+                this->_kwargs = std::move(other._kwargs);
             }
             return *this;
         }
 
+        /**
+         * Moves ownership from this object to the arguments.
+         */
+        void move_to(OwnedObject& args, OwnedObject& kwargs) noexcept
+        {
+            args = std::move(this->_args);
+            kwargs = std::move(this->_kwargs);
+        }
+
         /**
          * Acquires ownership of the argument (consumes the reference).
          */
@@ -273,9 +403,8 @@ namespace greenlet
         SwitchingArgs& operator<<=(OwnedObject& args)
         {
             assert(&args != &this->_args);
-            this->_args = args;
+            this->_args = std::move(args);
             this->_kwargs.CLEAR();
-            args.CLEAR();
 
             return *this;
         }
@@ -305,11 +434,103 @@ namespace greenlet
         }
     };
 
+    // What a greenlet has used while accounting was enabled in its
+    // thread (see ``greenlet.enable_accounting()``), in nanoseconds.
+    struct Accounting
+    {
+        uint64_t run_time = 0;
+        uint64_t cpu_time = 0;
+        uint64_t switches = 0;
+        // The monotonic clock when we were last switched in; 0 if we
+        // never were.
+        uint64_t switched_in = 0;
+        // The clocks when our clock last started running. That's
+        // usually when we were switched in, but it's also when
+        // accounting was turned on while we were current. The CPU
+        // clock is 0 if it wasn't being read.
+        uint64_t started = 0;
+        uint64_t cpu_started = 0;
+        // Whether our clock is running.
+        bool running = false;
+
+        inline void start(uint64_t now, uint64_t cpu_now) noexcept
+        {
+            this->started = now;
+            this->cpu_started = cpu_now;
+            this->running = true;
+        }
+
+        inline void stop(uint64_t now, uint64_t cpu_now) noexcept
+        {
+            if (this->running) {
+                this->run_time += now - this->started;
+                if (this->cpu_started && cpu_now) {
+                    this->cpu_time += cpu_now - this->cpu_started;
+                }
+                this->running = false;
+            }
+        }
+
+        static uint64_t monotonic_ns() noexcept;
+        // The CPU time used by the calling thread, or 0 if the
+        // platform can't tell us.
+        static uint64_t thread_cpu_ns() noexcept;
+    };
+
     class ThreadState;
 
+    class Greenlet;
     class UserGreenlet;
     class MainGreenlet;
 
+    // A link in the list of the greenlets of a thread that have
+    // started and not yet finished (see
+    // ``ThreadState::live_greenlets``). The list is circular, and
+    // starts and ends with a link that belongs to the ThreadState and
+    // has no greenlet. It's only changed with the GIL held.
+    struct LiveLink
+    {
+        LiveLink* prev;
+        LiveLink* next;
+        Greenlet* const greenlet;
+
+        explicit LiveLink(Greenlet* greenlet)
+            : prev(nullptr),
+              next(nullptr),
+              greenlet(greenlet)
+        {}
+
+        // Make this the (empty) list.
+        inline void make_list() noexcept
+        {
+            this->prev = this->next = this;
+        }
+
+        inline bool linked() const noexcept
+        {
+            return this->next != nullptr;
+        }
+
+        // Add this to the end of *list*.
+        inline void link(LiveLink& list) noexcept
+        {
+            assert(!this->linked());
+            this->next = &list;
+            this->prev = list.prev;
+            list.prev->next = this;
+            list.prev = this;
+        }
+
+        inline void unlink() noexcept
+        {
+            if (this->next) {
+                this->prev->next = this->next;
+                this->next->prev = this->prev;
+                this->prev = this->next = nullptr;
+            }
+        }
+    };
+
     class Greenlet
     {
     private:
@@ -325,6 +546,29 @@ namespace greenlet
         StackState stack_state;
         PythonState python_state;
         Greenlet(PyGreenlet* p, const StackState& initial_state);
+
+        // Greenlets may cache what they learn from their parent chain
+        // (see UserGreenlet). We don't keep track of our children,
+        // so when the parent, main greenlet or started state of a
+        // greenlet that has (or had) children changes, we bump this
+        // to invalidate all the caches. Changing a greenlet that never
+        // had any children only affects its own cache.
+        static uint64_t lineage_epoch;
+        bool _may_have_children = false;
+
+        // Link for the ThreadState list of greenlets waiting to be
+        // deleted in their own thread.
+        PyGreenlet* _deleteme_next = nullptr;
+
+        // Link for the ThreadState list of greenlets that are
+        // running or suspended.
+        LiveLink _live_link {this};
+
+        Accounting _accounting;
+
+        // Call this *before* changing any of those things, because
+        // dropping references can run arbitrary code.
+        virtual void lineage_changed() noexcept;
     public:
         Greenlet(PyGreenlet* p);
         virtual ~Greenlet();
@@ -350,6 +594,11 @@ namespace greenlet
             return this->switch_args;
         }
 
+        inline Accounting& accounting() noexcept
+        {
+            return this->_accounting;
+        }
+
         virtual const refs::BorrowedMainGreenlet main_greenlet() const = 0;
 
         inline intptr_t stack_saved() const noexcept
@@ -368,6 +617,13 @@ namespace greenlet
         }
 
         virtual OwnedObject throw_GreenletExit_during_dealloc(const ThreadState& current_thread_state);
+        // Switch to this greenlet (or the first live one in its
+        // parent chain). Like the C API, an exception that reaches us
+        // from the other greenlet (raised by its ``run``, or by
+        // ``throw()``) is reported by returning a null object with
+        // the Python error set; that's the common path when killing
+        // greenlets, and C++ exceptions are too expensive for it.
+        // Only failures to switch at all throw PyErrOccurred.
         virtual OwnedObject g_switch() = 0;
         /**
          * Force the greenlet to appear dead. Used when it's not
@@ -385,6 +641,12 @@ namespace greenlet
          * it DOES NOT lose the main greenlet or thread state.
          */
         inline void deactivate_and_free();
+        // Take us off the list of our thread's live greenlets, if
+        // we're on it.
+        inline void forget_live() noexcept
+        {
+            this->_live_link.unlink();
+        }
 
 
         // Called when some thread wants to deallocate a greenlet
@@ -400,12 +662,18 @@ namespace greenlet
         // frames to skip the ones that are being stored on the C stack (which
         // can't be safely accessed while the greenlet is suspended because
         // that stack space might be hosting a different greenlet), and
-        // sets PythonState::frames_were_exposed so we remember to restore
+        // records what it did in the PythonState so we remember to restore
         // the original list before resuming the greenlet. The C-stack frames
         // are a low-level interpreter implementation detail; while they're
         // important to the bytecode eval loop, they're superfluous for
-        // introspection purposes.
-        void expose_frames();
+        // introspection purposes. This is incremental: frames that were
+        // already exposed the last time we were suspended, and that are
+        // still running, aren't walked again. Returns how many frames
+        // were rewritten.
+        unsigned int expose_frames();
+
+        // See PythonState::collect_frames(). We must be suspended.
+        void collect_frames(std::vector<PythonState::CodeLine>& frames) const;
 
 
         // TODO: Figure out how to make these non-public.
@@ -429,6 +697,10 @@ namespace greenlet
         }
         virtual refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const = 0;
 
+        // The number of greenlets in our parent chain; zero for
+        // main greenlets (and garbage collected user greenlets).
+        virtual Py_ssize_t lineage_depth() const = 0;
+
         virtual const OwnedGreenlet parent() const = 0;
         virtual void parent(const refs::BorrowedObject new_parent) = 0;
 
@@ -497,6 +769,13 @@ namespace greenlet
             {
             }
 
+            switchstack_result_t(int err, Greenlet* state, OwnedGreenlet&& origin)
+                : status(err),
+                  the_new_current_greenlet(state),
+                  origin_greenlet(std::move(origin))
+            {
+            }
+
             switchstack_result_t(int err, Greenlet* state, const BorrowedGreenlet& origin)
                 : status(err),
                   the_new_current_greenlet(state),
@@ -510,6 +789,12 @@ namespace greenlet
                   origin_greenlet(other.origin_greenlet)
             {}
 
+            switchstack_result_t(switchstack_result_t&& other) noexcept
+                : status(other.status),
+                  the_new_current_greenlet(other.the_new_current_greenlet),
+                  origin_greenlet(std::move(other.origin_greenlet))
+            {}
+
             switchstack_result_t& operator=(const switchstack_result_t& other)
             {
                 this->status = other.status;
@@ -517,6 +802,14 @@ namespace greenlet
                 this->origin_greenlet = other.origin_greenlet;
                 return *this;
             }
+
+            switchstack_result_t& operator=(switchstack_result_t&& other) noexcept
+            {
+                this->status = other.status;
+                this->the_new_current_greenlet = other.the_new_current_greenlet;
+                this->origin_greenlet = std::move(other.origin_greenlet);
+                return *this;
+            }
         };
 
         OwnedObject on_switchstack_or_initialstub_failure(
@@ -546,14 +839,13 @@ namespace greenlet
         /**
            Perform a stack switch into this greenlet.
 
-           This temporarily sets the global variable
+           This temporarily sets the thread-local variable
            ``switching_thread_state`` to this greenlet; as soon as the
            call to ``slp_switch`` completes, this is reset to NULL.
-           Consequently, this depends on the GIL.
 
            TODO: Adopt the stackman model and pass ``slp_switch`` a
            callback function and context pointer; this eliminates the
-           need for global variables altogether.
+           need for that variable altogether.
 
            Because the stack switch happens in this function, this
            function can't use its own stack (local) variables, set
@@ -644,6 +936,22 @@ public:
         OwnedMainGreenlet _main_greenlet;
         OwnedObject _run_callable;
         OwnedGreenlet _parent;
+
+        // Answers about the parent chain, cached so that
+        // find_main_greenlet_in_lineage() and lineage_depth() don't
+        // have to walk it every time (with spawn trees thousands of
+        // greenlets deep, that walk can dominate a switch). Only
+        // valid while ``_lineage_cache_epoch == lineage_epoch``. The
+        // main greenlet needs no reference: as long as the epoch
+        // doesn't change, our parent chain keeps it alive.
+        mutable uint64_t _lineage_cache_epoch;
+        mutable refs::BorrowedMainGreenlet _lineage_main_greenlet;
+        mutable Py_ssize_t _lineage_depth;
+
+        void update_lineage_cache() const;
+        void clear_references();
+    protected:
+        virtual void lineage_changed() noexcept;
     public:
         static void* operator new(size_t UNUSED(count));
         static void operator delete(void* ptr);
@@ -652,6 +960,7 @@ public:
         virtual ~UserGreenlet();
 
         virtual refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const;
+        virtual Py_ssize_t lineage_depth() const;
         virtual bool was_running_in_dead_thread() const noexcept;
         virtual ThreadState* thread_state() const noexcept;
         virtual OwnedObject g_switch();
@@ -739,6 +1048,7 @@ public:
         virtual const refs::BorrowedMainGreenlet main_greenlet() const;
 
         virtual refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const;
+        virtual Py_ssize_t lineage_depth() const;
         virtual bool was_running_in_dead_thread() const noexcept;
         virtual ThreadState* thread_state() const noexcept;
         void thread_state(ThreadState*) noexcept;
@@ -789,6 +1099,19 @@ public:
         return results;
     }
 
+    static inline OwnedObject
+    single_result(OwnedObject&& results)
+    {
+        if (results
+            && PyTuple_Check(results.borrow())
+            && PyTuple_GET_SIZE(results.borrow()) == 1) {
+            PyObject* result = PyTuple_GET_ITEM(results.borrow(), 0);
+            assert(result);
+            return OwnedObject::owning(result);
+        }
+        return std::move(results);
+    }
+
 
     static OwnedObject
     g_handle_exit(const OwnedObject& greenlet_result);
@@ -3,6 +3,7 @@
 
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <utility>
 //#include "greenlet_internal.hpp"
 #include "greenlet_compiler_compat.hpp"
 #include "greenlet_cpython_compat.hpp"
@@ -107,6 +108,47 @@ namespace greenlet
         }
 
         typedef OwnedReference<PyObject, ContextExactChecker> OwnedContext;
+
+        // Type checking policy.
+        //
+        // Raw pointers that come to us from outside (arguments,
+        // attribute values, the results of C API calls) are always
+        // checked when they're wrapped. But once a pointer has passed
+        // a checker, converting it to another reference type whose
+        // checker it must also pass is "trusted": release builds skip
+        // the check, debug builds still do it to catch our mistakes.
+        // This matters in the switching paths, which convert between
+        // owned and borrowed greenlet references several times per
+        // switch.
+        //
+        // The checker that a pointer already passed is carried in the
+        // type of a tag argument, so all this is decided at compile
+        // time. ``CheckedBy<NoOpChecker>`` means nothing was checked.
+        template <TypeChecker FROM>
+        struct CheckedBy
+        {
+        };
+
+        // Does passing FROM guarantee passing TO?
+        template <TypeChecker FROM, TypeChecker TO>
+        struct CheckerImplies
+        {
+            static constexpr bool value = TO == NoOpChecker
+                || FROM == TO
+                // Main greenlets are exactly PyGreenlet_Type.
+                || (FROM == MainGreenletExactChecker && TO == GreenletChecker);
+        };
+
+        template <TypeChecker TC, TypeChecker FROM>
+        inline void CheckTrusted(void* p)
+        {
+#ifdef NDEBUG
+            if (CheckerImplies<FROM, TC>::value) {
+                return;
+            }
+#endif
+            TC(p);
+        }
     }
 }
 
@@ -150,6 +192,38 @@ namespace greenlet {
     // that way.
 
 
+    // (4) Prefer moving (``std::move``) owned references to copying
+    // them when the source isn't needed anymore; a move transfers
+    // the reference without touching the reference count.
+
+#ifndef NDEBUG
+    // In debug builds, count the reference count changes made by the
+    // owning classes below, so that tests can check how many a
+    // switch takes. See ``get_refcount_operations``.
+    static Py_ssize_t refcount_operations = 0;
+#  define G_COUNT_REFCOUNT_OPERATION() (++greenlet::refs::refcount_operations)
+#else
+#  define G_COUNT_REFCOUNT_OPERATION() ((void)0)
+#endif
+
+    template <typename T>
+    inline void xincref(T* p) noexcept
+    {
+        if (p) {
+            G_COUNT_REFCOUNT_OPERATION();
+            Py_INCREF(p);
+        }
+    }
+
+    template <typename T>
+    inline void xdecref(T* p) noexcept
+    {
+        if (p) {
+            G_COUNT_REFCOUNT_OPERATION();
+            Py_DECREF(p);
+        }
+    }
+
     // This is the base class for things that can be done with a
     // PyObject pointer. It assumes nothing about memory management.
     // NOTE: Nothing is virtual, so subclasses shouldn't add new
@@ -167,6 +241,15 @@ namespace greenlet {
             TC(p);
         }
 
+    protected:
+        template <TypeChecker FROM>
+        PyObjectPointer(T* it, CheckedBy<FROM>) : p(it)
+        {
+            CheckTrusted<TC, FROM>(p);
+        }
+
+    public:
+
         // We don't allow automatic casting to PyObject* at this
         // level, because then we could be passed to Py_DECREF/INCREF,
         // but we want nothing to do with memory management. If you
@@ -290,6 +373,24 @@ namespace greenlet {
         {
         }
 
+        // Steals the reference.
+        template <TypeChecker FROM>
+        OwnedReference(T* it, CheckedBy<FROM> checked)
+            : PyObjectPointer<T, TC>(it, checked)
+        {
+        }
+
+        template <TypeChecker FROM>
+        OwnedReference<T, TC>& assign(T* const other, CheckedBy<FROM>)
+        {
+            CheckTrusted<TC, FROM>(other);
+            xincref(other);
+            T* tmp = this->p;
+            this->p = other;
+            xdecref(tmp);
+            return *this;
+        }
+
     public:
 
         // Constructors
@@ -302,7 +403,7 @@ namespace greenlet {
         static OwnedReference<T, TC> owning(T* p)
         {
             OwnedReference<T, TC> result(p);
-            Py_XINCREF(result.p);
+            xincref(result.p);
             return result;
         }
 
@@ -315,18 +416,24 @@ namespace greenlet {
             T* op = other.borrow();
             TC(op);
             this->p = other.borrow();
-            Py_XINCREF(this->p);
+            xincref(this->p);
         }
 
-        // It would be good to make use of the C++11 distinction
-        // between move and copy operations, e.g., constructing from a
-        // pointer should be a move operation.
         // In the common case of ``OwnedObject x = Py_SomeFunction()``,
         // the call to the copy constructor will be elided completely.
         OwnedReference(const OwnedReference<T, TC>& other)
             : PyObjectPointer<T, TC>(other.p)
         {
-            Py_XINCREF(this->p);
+            xincref(this->p);
+        }
+
+        // Takes over the reference from *other*, leaving it empty.
+        // No type check is needed, *other* already passed it.
+        OwnedReference(OwnedReference<T, TC>&& other) noexcept
+            : PyObjectPointer<T, TC>(nullptr)
+        {
+            this->p = other.p;
+            other.p = nullptr;
         }
 
         static OwnedReference<PyObject> None()
@@ -338,10 +445,21 @@ namespace greenlet {
         // We can assign from exactly our type without any extra checking
         OwnedReference<T, TC>& operator=(const OwnedReference<T, TC>& other)
         {
-            Py_XINCREF(other.p);
-            const T* tmp = this->p;
+            xincref(other.p);
+            T* tmp = this->p;
             this->p = other.p;
-            Py_XDECREF(tmp);
+            xdecref(tmp);
+            return *this;
+        }
+
+        OwnedReference<T, TC>& operator=(OwnedReference<T, TC>&& other) noexcept
+        {
+            if (this != &other) {
+                T* tmp = this->p;
+                this->p = other.p;
+                other.p = nullptr;
+                xdecref(tmp);
+            }
             return *this;
         }
 
@@ -352,12 +470,7 @@ namespace greenlet {
 
         OwnedReference<T, TC>& operator=(T* const other)
         {
-            TC(other);
-            Py_XINCREF(other);
-            T* tmp = this->p;
-            this->p = other;
-            Py_XDECREF(tmp);
-            return *this;
+            return this->assign(other, CheckedBy<NoOpChecker>());
         }
 
         // We can assign from an arbitrary reference type
@@ -389,7 +502,7 @@ namespace greenlet {
             // Return a new reference.
             // TODO: This may go away when we have reference objects
             // throughout the code.
-            Py_XINCREF(this->p);
+            xincref(this->p);
             return this->p;
         }
 
@@ -397,13 +510,16 @@ namespace greenlet {
         // should be able to get away without virtual.
         ~OwnedReference()
         {
-            Py_CLEAR(this->p);
+            this->CLEAR();
         }
 
         void CLEAR()
         {
-            Py_CLEAR(this->p);
-            assert(this->p == nullptr);
+            // Like Py_CLEAR, in case decrementing runs code that
+            // looks at us.
+            T* tmp = this->p;
+            this->p = nullptr;
+            xdecref(tmp);
         }
     };
 
@@ -463,8 +579,13 @@ namespace greenlet {
         _OwnedGreenlet(const _OwnedGreenlet<T, TC>& other) : OwnedReference<T, TC>(other)
         {
         }
+        _OwnedGreenlet(_OwnedGreenlet<T, TC>&& other) noexcept
+            : OwnedReference<T, TC>(std::move(other))
+        {
+        }
         _OwnedGreenlet(OwnedMainGreenlet& other) :
-            OwnedReference<T, TC>(reinterpret_cast<T*>(other.acquire()))
+            OwnedReference<T, TC>(reinterpret_cast<T*>(other.acquire()),
+                                  CheckedBy<MainGreenletExactChecker>())
         {
         }
         _OwnedGreenlet(const BorrowedGreenlet& other);
@@ -476,7 +597,14 @@ namespace greenlet {
 
         inline _OwnedGreenlet<T, TC>& operator=(const OwnedGreenlet& other)
         {
-            return this->operator=(other.borrow());
+            this->assign(other.borrow(), CheckedBy<GreenletChecker>());
+            return *this;
+        }
+
+        _OwnedGreenlet<T, TC>& operator=(_OwnedGreenlet<T, TC>&& other) noexcept
+        {
+            OwnedReference<T, TC>::operator=(std::move(other));
+            return *this;
         }
 
         inline _OwnedGreenlet<T, TC>& operator=(const BorrowedGreenlet& other);
@@ -484,7 +612,7 @@ namespace greenlet {
         _OwnedGreenlet<T, TC>& operator=(const OwnedMainGreenlet& other)
         {
             PyGreenlet* owned = other.acquire();
-            Py_XDECREF(this->p);
+            xdecref(this->p);
             this->p = reinterpret_cast<T*>(owned);
             return *this;
         }
@@ -514,6 +642,12 @@ namespace greenlet {
     template <typename T=PyObject, TypeChecker TC=NoOpChecker>
     class BorrowedReference : public PyObjectPointer<T, TC>
     {
+    protected:
+        template <TypeChecker FROM>
+        BorrowedReference(T* it, CheckedBy<FROM> checked)
+            : PyObjectPointer<T, TC>(it, checked)
+        {}
+
     public:
         // Allow implicit creation from PyObject* pointers as we
         // transition to using these classes. Also allow automatic
@@ -540,6 +674,12 @@ namespace greenlet {
     template<typename T=PyGreenlet, TypeChecker TC=GreenletChecker>
     class _BorrowedGreenlet : public BorrowedReference<T, TC>
     {
+    protected:
+        template <TypeChecker FROM>
+        _BorrowedGreenlet(T* it, CheckedBy<FROM> checked)
+            : BorrowedReference<T, TC>(it, checked)
+        {}
+
     public:
         _BorrowedGreenlet() :
             BorrowedReference<T, TC>(nullptr)
@@ -552,9 +692,16 @@ namespace greenlet {
         _BorrowedGreenlet(const BorrowedObject& it);
 
         _BorrowedGreenlet(const OwnedGreenlet& it) :
-            BorrowedReference<T, TC>(it.borrow())
+            BorrowedReference<T, TC>(it.borrow(), CheckedBy<GreenletChecker>())
         {}
 
+        // For internal pointers whose type we already know, like
+        // the origin of a switch. Only checked in debug builds.
+        static _BorrowedGreenlet<T, TC> trusted(T* it)
+        {
+            return _BorrowedGreenlet<T, TC>(it, CheckedBy<TC>());
+        }
+
         _BorrowedGreenlet<T, TC>& operator=(const BorrowedObject& other);
 
         // We get one of these for PyGreenlet, but one for PyObject
@@ -571,9 +718,10 @@ namespace greenlet {
 
     template<typename T, TypeChecker TC>
     _OwnedGreenlet<T, TC>::_OwnedGreenlet(const BorrowedGreenlet& other)
-        : OwnedReference<T, TC>(reinterpret_cast<T*>(other.borrow()))
+        : OwnedReference<T, TC>(reinterpret_cast<T*>(other.borrow()),
+                                CheckedBy<GreenletChecker>())
     {
-        Py_XINCREF(this->p);
+        xincref(this->p);
     }
 
 
@@ -582,7 +730,9 @@ namespace greenlet {
     {
     public:
         BorrowedMainGreenlet(const OwnedMainGreenlet& it) :
-            _BorrowedGreenlet<PyGreenlet, MainGreenletExactChecker>(it.borrow())
+            _BorrowedGreenlet<PyGreenlet, MainGreenletExactChecker>(
+                it.borrow(),
+                CheckedBy<MainGreenletExactChecker>())
         {}
         BorrowedMainGreenlet(PyGreenlet* it=nullptr)
             : _BorrowedGreenlet<PyGreenlet, MainGreenletExactChecker>(it)
@@ -592,7 +742,8 @@ namespace greenlet {
     template<typename T, TypeChecker TC>
     _OwnedGreenlet<T, TC>& _OwnedGreenlet<T, TC>::operator=(const BorrowedGreenlet& other)
     {
-        return this->operator=(other.borrow());
+        this->assign(other.borrow(), CheckedBy<GreenletChecker>());
+        return *this;
     }
 
 
@@ -843,20 +994,15 @@ namespace greenlet {
     };
 
     // Use this to represent the module object used at module init
-    // time.
-    // This could either be a borrowed (Py2) or new (Py3) reference;
-    // either way, we don't want to do any memory management
-    // on it here, Python itself will handle that.
-    // XXX: Actually, that's not quite right. On Python 3, if an
-    // exception occurs before we return to the interpreter, this will
-    // leak; but all previous versions also had that problem.
+    // time. It's created by the import system, which owns it and
+    // passes it to our exec function; we don't do any memory
+    // management on it here.
     class CreatedModule : public PyObjectPointer<>
     {
     private:
         G_NO_COPIES_OF_CLS(CreatedModule);
     public:
-        CreatedModule(PyModuleDef& mod_def) : PyObjectPointer<>(
-            Require(PyModule_Create(&mod_def)))
+        CreatedModule(PyObject* module) : PyObjectPointer<>(module)
         {
         }
 
@@ -897,7 +1043,7 @@ namespace greenlet {
                 Require(PyModule_AddObject(this->p, name, new_object));
             }
             catch (const PyErrOccurred&) {
-                Py_DECREF(p);
+                Py_DECREF(new_object);
                 throw;
             }
         }
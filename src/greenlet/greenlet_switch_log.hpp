@@ -0,0 +1,139 @@
+#ifndef GREENLET_SWITCH_LOG_HPP
+#define GREENLET_SWITCH_LOG_HPP
+
+/**
+ * A fixed-size ring of records describing the switches made in one
+ * thread. See ``greenlet.start_switch_log()``.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "greenlet_clock.hpp"
+#include "greenlet_compiler_compat.hpp"
+#include "greenlet_exceptions.hpp"
+
+namespace greenlet {
+
+// One record. Its layout is published to Python as
+// ``greenlet.SWITCH_LOG_FORMAT``; keep them in sync.
+struct SwitchRecord
+{
+    // Counts up from 0 for each log. A gap means older records were
+    // overwritten before they were drained.
+    uint64_t sequence;
+    // See steady_clock_ns().
+    uint64_t timestamp;
+    // The ``id()`` of the greenlets.
+    uint64_t origin;
+    uint64_t target;
+    // How much C stack the switch copied to and from the heap.
+    uint64_t stack_bytes;
+    // One of the PyGreenlet_TRACE_* values.
+    uint32_t event;
+    // Always 0. Spelled out so that no uninitialized padding is
+    // copied into drained records.
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SwitchRecord) == 48, "SWITCH_LOG_FORMAT is out of date");
+
+/**
+ * Only the thread that owns the log writes to it or drains it, and
+ * it holds the GIL when it does either, so no locking is needed.
+ * Writing a record never allocates or fails; when the ring is full
+ * the oldest record is overwritten.
+ */
+class SwitchLog
+{
+private:
+    SwitchRecord* const records;
+    const uint64_t capacity;
+    // Total number of records ever written, and ever consumed
+    // (drained or overwritten).
+    uint64_t written;
+    uint64_t consumed;
+
+    G_NO_COPIES_OF_CLS(SwitchLog);
+
+    SwitchLog(SwitchRecord* records, uint64_t capacity)
+        : records(records),
+          capacity(capacity),
+          written(0),
+          consumed(0)
+    {}
+
+public:
+    static const char* const format;
+
+    static SwitchLog* create(size_t capacity)
+    {
+        if (capacity > PY_SSIZE_T_MAX / sizeof(SwitchRecord)) {
+            throw PyErrOccurred(PyExc_OverflowError, "switch log too large");
+        }
+        SwitchRecord* records = static_cast<SwitchRecord*>(
+            PyMem_Malloc(capacity * sizeof(SwitchRecord)));
+        if (!records) {
+            PyErr_NoMemory();
+            throw PyErrOccurred();
+        }
+        return new SwitchLog(records, capacity);
+    }
+
+    ~SwitchLog()
+    {
+        PyMem_Free(this->records);
+    }
+
+    inline void record(uint32_t event,
+                       const void* origin,
+                       const void* target,
+                       intptr_t stack_bytes) noexcept
+    {
+        SwitchRecord& r = this->records[this->written % this->capacity];
+        r.sequence = this->written++;
+        r.timestamp = steady_clock_ns();
+        r.origin = reinterpret_cast<uintptr_t>(origin);
+        r.target = reinterpret_cast<uintptr_t>(target);
+        r.stack_bytes = stack_bytes;
+        r.event = event;
+        r.reserved = 0;
+    }
+
+    /**
+     * How many records are waiting to be drained.
+     */
+    inline size_t available() noexcept
+    {
+        if (this->written - this->consumed > this->capacity) {
+            this->consumed = this->written - this->capacity;
+        }
+        return this->written - this->consumed;
+    }
+
+    /**
+     * Copy up to *count* of the oldest waiting records to *dest*,
+     * and forget them. Returns the number copied.
+     */
+    size_t drain(char* dest, size_t count) noexcept
+    {
+        count = std::min(count, this->available());
+        for (size_t copied = 0; copied < count; ) {
+            const uint64_t start = this->consumed % this->capacity;
+            const size_t n = std::min<size_t>(count - copied, this->capacity - start);
+            memcpy(dest + copied * sizeof(SwitchRecord),
+                   this->records + start,
+                   n * sizeof(SwitchRecord));
+            copied += n;
+            this->consumed += n;
+        }
+        return count;
+    }
+};
+
+const char* const SwitchLog::format = "QQQQQI4x";
+
+}; // namespace greenlet
+
+#endif // GREENLET_SWITCH_LOG_HPP
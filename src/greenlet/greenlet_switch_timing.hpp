@@ -0,0 +1,155 @@
+#ifndef GREENLET_SWITCH_TIMING_HPP
+#define GREENLET_SWITCH_TIMING_HPP
+
+/**
+ * Histograms of how long the phases of the switches made in one
+ * thread take. See ``greenlet.enable_switch_histograms()``.
+ */
+
+#include <cstdint>
+
+#include "greenlet_clock.hpp"
+#include "greenlet_compiler_compat.hpp"
+
+namespace greenlet {
+
+/**
+ * Counts of durations, in nanoseconds, in log-linear buckets, like
+ * an HDR histogram with two significant bits: durations under 8ns
+ * each have a bucket, and every power of two after that is split into
+ * four, so a bucket is never more than 25% wide. Durations of
+ * 2**36ns (about 69 seconds) or more all go in the last bucket.
+ *
+ * The lower bounds of the buckets are published to Python as
+ * ``greenlet.SWITCH_HISTOGRAM_BOUNDS``.
+ */
+class LatencyHistogram
+{
+public:
+    static const unsigned int LINEAR_BUCKETS = 8;
+    static const unsigned int MAX_EXPONENT = 35;
+    static const unsigned int BUCKETS = LINEAR_BUCKETS + (MAX_EXPONENT - 2) * 4;
+
+    uint64_t counts[BUCKETS];
+
+    LatencyHistogram() : counts()
+    {}
+
+    static inline unsigned int bucket(uint64_t ns) noexcept
+    {
+        if (ns < LINEAR_BUCKETS) {
+            return static_cast<unsigned int>(ns);
+        }
+#if defined(__GNUC__) || defined(__clang__)
+        const unsigned int exponent = 63 - __builtin_clzll(ns);
+#else
+        unsigned int exponent = 0;
+        for (uint64_t v = ns >> 1; v; v >>= 1) {
+            exponent++;
+        }
+#endif
+        if (exponent > MAX_EXPONENT) {
+            return BUCKETS - 1;
+        }
+        return LINEAR_BUCKETS + (exponent - 3) * 4 + ((ns >> (exponent - 2)) & 3);
+    }
+
+    static inline uint64_t lower_bound(unsigned int bucket) noexcept
+    {
+        if (bucket < LINEAR_BUCKETS) {
+            return bucket;
+        }
+        const unsigned int exponent = 3 + (bucket - LINEAR_BUCKETS) / 4;
+        const uint64_t sub = (bucket - LINEAR_BUCKETS) % 4;
+        return (4 + sub) << (exponent - 2);
+    }
+
+    inline void record(uint64_t ns) noexcept
+    {
+        this->counts[LatencyHistogram::bucket(ns)]++;
+    }
+};
+
+/**
+ * The histograms of one thread. Only that thread records into them
+ * or reads them, holding the GIL, so no locking is needed.
+ *
+ * A switch is timed from when the origin starts saving its state
+ * until the target has called the trace functions, in
+ * ``g_switch_finish()`` or, for a new greenlet, ``inner_bootstrap()``.
+ * If a trace function switches, the outer switch isn't counted.
+ */
+class SwitchTiming
+{
+private:
+    G_NO_COPIES_OF_CLS(SwitchTiming);
+
+public:
+    enum Phase {
+        // The whole switch.
+        TOTAL,
+        // Saving the origin's interpreter and exception state.
+        CAPTURE,
+        // Making the origin's frames walkable; see expose_frames().
+        EXPOSE,
+        // Copying C stack to the heap, and back.
+        SAVE,
+        RESTORE,
+        // Calling the native and Python trace functions, when there
+        // are any.
+        TRACE,
+        PHASES
+    };
+    static const char* const phase_names[PHASES];
+
+    LatencyHistogram histograms[PHASES];
+    // When the switch in progress started, or 0.
+    uint64_t switch_started;
+
+    SwitchTiming() : switch_started(0)
+    {}
+
+    static inline uint64_t now() noexcept
+    {
+        return steady_clock_ns();
+    }
+
+    /**
+     * Record the phase that started at *start*, and return the
+     * time it ended.
+     */
+    inline uint64_t record(Phase phase, uint64_t start) noexcept
+    {
+        const uint64_t end = SwitchTiming::now();
+        this->histograms[phase].record(end - start);
+        return end;
+    }
+
+    /**
+     * The target of a switch has finished with it. If it called
+     * trace functions, *trace_started* is when it began to.
+     */
+    inline void finish_switch(uint64_t trace_started) noexcept
+    {
+        if (trace_started) {
+            this->record(TRACE, trace_started);
+        }
+        if (this->switch_started) {
+            this->record(TOTAL, this->switch_started);
+            this->switch_started = 0;
+        }
+    }
+};
+
+const char* const SwitchTiming::phase_names[SwitchTiming::PHASES] = {
+    "total",
+    "capture",
+    "expose",
+    "save",
+    "restore",
+    "trace",
+};
+
+}; // namespace greenlet
+
+#endif // GREENLET_SWITCH_TIMING_HPP
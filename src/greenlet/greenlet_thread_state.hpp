@@ -1,12 +1,20 @@
 #ifndef GREENLET_THREAD_STATE_HPP
 #define GREENLET_THREAD_STATE_HPP
 
+#include <atomic>
+#include <chrono>
 #include <ctime>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
 #include <stdexcept>
 
 #include "greenlet_internal.hpp"
 #include "greenlet_refs.hpp"
 #include "greenlet_thread_support.hpp"
+#include "greenlet_switch_log.hpp"
+#include "greenlet_switch_timing.hpp"
 
 using greenlet::refs::BorrowedObject;
 using greenlet::refs::BorrowedGreenlet;
@@ -87,6 +95,82 @@ namespace greenlet {
  */
 
 
+/**
+ * A switch into (or throw into) a greenlet that was requested with
+ * ``switch_threadsafe()`` or ``throw_threadsafe()``, waiting for the
+ * thread the greenlet belongs to. Owns its references.
+ */
+struct PendingSwitch {
+    PendingSwitch* next;
+    OwnedGreenlet target;
+    /* The arguments for switch(), or for throw() if is_throw. */
+    OwnedObject args;
+    OwnedObject kwargs;
+    const bool is_throw;
+
+    PendingSwitch(const BorrowedGreenlet& target,
+                  const BorrowedObject args,
+                  const BorrowedObject kwargs,
+                  const bool is_throw)
+        : next(nullptr),
+          target(target),
+          args(args),
+          kwargs(kwargs),
+          is_throw(is_throw)
+    {}
+};
+
+/**
+ * What the watchdog (see TWatchdog.cpp) needs to know about a thread
+ * it watches. Shared between the thread's state and the watchdog.
+ */
+struct StallWatch {
+    /* Written by the thread on every switch, and read by the
+       watchdog without the GIL. */
+    std::atomic<uint64_t> switches;
+    std::atomic<PyGreenlet*> current;
+    /* Set when the watch is replaced or removed, or the thread
+       exits. */
+    std::atomic<bool> stopped;
+
+    /* Set when the watch is created. */
+    const unsigned long thread_id;
+    const std::chrono::nanoseconds threshold;
+    /* Only touched with the GIL held; cleared when stopped. */
+    OwnedObject callback;
+
+    /* Only touched by the watchdog thread. */
+    uint64_t seen_switches;
+    std::chrono::steady_clock::time_point seen_at;
+    bool reported;
+
+    StallWatch(PyGreenlet* current,
+               const std::chrono::nanoseconds threshold,
+               const BorrowedObject callback)
+        : switches(0),
+          current(current),
+          stopped(false),
+          thread_id(PyThread_get_thread_ident()),
+          threshold(threshold),
+          callback(callback),
+          seen_switches(0),
+          seen_at(std::chrono::steady_clock::now()),
+          reported(false)
+    {}
+
+    ~StallWatch()
+    {
+        // We may be destroyed in the watchdog thread, without the GIL.
+        assert(!this->callback);
+    }
+
+    // Must hold the GIL.
+    void stop()
+    {
+        this->stopped = true;
+        this->callback.CLEAR();
+    }
+};
 
 class ThreadState {
 private:
@@ -103,23 +187,67 @@ private:
 
     /* Strong reference to the trace function, if any. */
     OwnedObject tracefunc;
-
-    typedef std::vector<PyGreenlet*, PythonAllocator<PyGreenlet*> > deleteme_t;
-    /* A vector of raw PyGreenlet pointers representing things that need
-       deleted when this thread is running. The vector owns the
-       references, but you need to manually INCREF/DECREF as you use
-       them. We don't use a vector<refs::OwnedGreenlet> because we
-       make copy of this vector, and that would become O(n) as all the
-       refcounts are incremented in the copy.
+    /* The native trace function, the context to pass it, and the
+       events it wants; the mask is 0 when there is none. */
+    PyGreenlet_TraceFunc native_trace;
+    void* native_trace_context;
+    int native_trace_mask;
+    /* Where our switches are recorded, if anywhere. */
+    std::unique_ptr<SwitchLog> switch_log;
+    /* Where our switches are timed, if anywhere. */
+    std::unique_ptr<SwitchTiming> switch_timing;
+    /* Whether our greenlets keep track of the time they run, and
+       also of their CPU time. */
+    bool account_run_time;
+    bool account_cpu_time;
+    /* Our part of the watchdog, if it's watching us. */
+    std::shared_ptr<StallWatch> stall_watch;
+    /* Our counters for get_stats(). */
+    SwitchStats _stats;
+    /* Every ThreadState that exists is on a list linked through
+       these, so get_stats() can add up their counters; those of
+       destroyed states are kept in ``retired_stats``. Only changed
+       with the GIL held. */
+    ThreadState* prev_state;
+    ThreadState* next_state;
+    /* The ident of the thread we belong to. */
+    const unsigned long thread_id;
+    /* Our greenlets that have started and not finished, oldest
+       first, not counting the main greenlet. */
+    LiveLink live_greenlets;
+    static ThreadState* all_states;
+    static SwitchStats retired_stats;
+
+    /* The head of a list of raw PyGreenlet pointers representing
+       things that need deleted when this thread is running. The list
+       is intrusive (linked through Greenlet::_deleteme_next; a
+       greenlet can only be on one such list at a time) and owns one
+       reference to each greenlet on it.
+
+       Any thread may push onto it (with a compare-and-swap), but only
+       this thread (or whoever is destroying us) takes things off,
+       and it does so by swapping the whole list out at once. That
+       keeps both sides O(1) and doesn't depend on the GIL.
     */
-    deleteme_t deleteme;
+    std::atomic<PyGreenlet*> deleteme;
+    /* Whether this state belongs to the interpreter's main thread,
+       which is the only one pending calls run in. */
+    const bool is_main_thread;
+
+    /* Switches into our greenlets queued by any thread, most recent
+       first; pushed just like ``deleteme``. */
+    std::atomic<PendingSwitch*> pending_switches;
+    /* Switches this thread took from ``pending_switches`` but hasn't
+       performed yet, oldest first. Only touched with the GIL held. */
+    PendingSwitch* ready_switches;
+    /* Called, in the queueing thread, when a switch is queued and
+       none were waiting. */
+    OwnedObject switch_wakeup;
 
 #ifdef GREENLET_NEEDS_EXCEPTION_STATE_SAVED
     void* exception_state;
 #endif
 
-    static std::clock_t _clocks_used_doing_gc;
-    static ImmortalString get_referrers_name;
     static PythonAllocator<ThreadState> allocator;
 
     G_NO_COPIES_OF_CLS(ThreadState);
@@ -136,15 +264,22 @@ public:
                                                  1);
     }
 
-    static void init()
-    {
-        ThreadState::get_referrers_name = "get_referrers";
-        ThreadState::_clocks_used_doing_gc = 0;
-    }
-
     ThreadState()
         : main_greenlet(OwnedMainGreenlet::consuming(green_create_main(this))),
-          current_greenlet(main_greenlet)
+          current_greenlet(main_greenlet),
+          native_trace(nullptr),
+          native_trace_context(nullptr),
+          native_trace_mask(0),
+          account_run_time(false),
+          account_cpu_time(false),
+          prev_state(nullptr),
+          next_state(ThreadState::all_states),
+          thread_id(PyThread_get_thread_ident()),
+          live_greenlets(nullptr),
+          deleteme(nullptr),
+          is_main_thread(_PyOS_IsMainThread()),
+          pending_switches(nullptr),
+          ready_switches(nullptr)
     {
         if (!this->main_greenlet) {
             // We failed to create the main greenlet. That's bad.
@@ -154,6 +289,12 @@ public:
         // then copied it to the current greenlet.
         assert(this->main_greenlet.REFCNT() == 2);
 
+        if (this->next_state) {
+            this->next_state->prev_state = this;
+        }
+        ThreadState::all_states = this;
+        this->live_greenlets.make_list();
+
 #ifdef GREENLET_NEEDS_EXCEPTION_STATE_SAVED
         this->exception_state = slp_get_exception_state();
 #endif
@@ -203,32 +344,20 @@ public:
     }
 
     /**
-     * In addition to returning a new reference to the currunt
-     * greenlet, this performs any maintenance needed.
-     */
-    inline OwnedGreenlet get_current()
-    {
-        /* green_dealloc() cannot delete greenlets from other threads, so
-           it stores them in the thread dict; delete them now. */
-        this->clear_deleteme_list();
-        //assert(this->current_greenlet->main_greenlet == this->main_greenlet);
-        //assert(this->main_greenlet->main_greenlet == this->main_greenlet);
-        return this->current_greenlet;
-    }
-
-    /**
-     * As for non-const get_current();
+     * Returns a new reference to the current greenlet.
+     *
+     * Does no maintenance, so it never runs arbitrary code. See
+     * ThreadState_Maintain().
      */
-    inline BorrowedGreenlet borrow_current()
+    inline OwnedGreenlet get_current() const
     {
-        this->clear_deleteme_list();
         return this->current_greenlet;
     }
 
     /**
-     * Does no maintenance.
+     * As for get_current().
      */
-    inline OwnedGreenlet get_current() const
+    inline BorrowedGreenlet borrow_current() const
     {
         return this->current_greenlet;
     }
@@ -244,10 +373,28 @@ public:
         this->current_greenlet = target;
     }
 
-private:
+    /**
+     * Makes *target* the current greenlet and returns the previous
+     * one, handing our reference to it to the caller. Does no
+     * maintenance.
+     */
+    inline OwnedGreenlet exchange_current(const BorrowedGreenlet& target)
+    {
+        OwnedGreenlet previous(std::move(this->current_greenlet));
+        this->current_greenlet = target;
+        return previous;
+    }
+
+    inline bool has_deleteme() const
+    {
+        return this->deleteme.load(std::memory_order_relaxed);
+    }
+
     /**
      * Deref and remove the greenlets from the deleteme list. Must be
-     * holding the GIL.
+     * holding the GIL. This can run arbitrary code, including
+     * switches, so it's never done in the middle of a switch. See
+     * ThreadState_Maintain().
      *
      * If *murder* is true, then we must be called from a different
      * thread than the one that these greenlets were running in.
@@ -258,16 +405,32 @@ private:
      */
     inline void clear_deleteme_list(const bool murder=false)
     {
-        if (!this->deleteme.empty()) {
+        // This is called at the end of every switch, so make the
+        // (very common) empty case cheap.
+        if (this->has_deleteme()) {
             // It's possible we could add items to this list while
             // running Python code if there's a thread switch, so we
-            // need to defensively copy it before that can happen.
-            deleteme_t copy = this->deleteme;
-            this->deleteme.clear(); // in case things come back on the list
-            for(deleteme_t::iterator it = copy.begin(), end = copy.end();
-                it != end;
-                ++it ) {
-                PyGreenlet* to_del = *it;
+            // take the whole thing now; anything added after this
+            // starts a new list.
+            PyGreenlet* pushed = this->deleteme.exchange(nullptr,
+                                                         std::memory_order_acquire);
+            // Items were pushed on the front; delete them in the
+            // order they were added.
+            PyGreenlet* to_del = nullptr;
+            this->_stats.deleteme_drains++;
+            while (pushed) {
+                PyGreenlet* const next = pushed->pimpl->_deleteme_next;
+                pushed->pimpl->_deleteme_next = to_del;
+                to_del = pushed;
+                pushed = next;
+                this->_stats.deleteme_greenlets++;
+            }
+            while (to_del) {
+                // We still own a reference to everything after
+                // to_del, so reading the link first is safe even if
+                // deleting to_del runs arbitrary code.
+                PyGreenlet* const next = to_del->pimpl->_deleteme_next;
+                to_del->pimpl->_deleteme_next = nullptr;
                 if (murder) {
                     // Force each greenlet to appear dead; we can't raise an
                     // exception into it anymore anyway.
@@ -285,12 +448,41 @@ private:
                     PyErr_WriteUnraisable(nullptr);
                     PyErr_Clear();
                 }
+                to_del = next;
             }
         }
     }
 
+private:
+    /**
+     * A pending call that drains the list of the thread running it,
+     * even if that thread never switches. If it's in the middle of a
+     * switch, it calls the thread's switch wakeup instead.
+     */
+    static int clear_deleteme_list_pending(void*);
+
+    /**
+     * The destructor of the capsule that
+     * ``clear_deleteme_list_at_exit()`` puts in the Python thread
+     * state's dictionary.
+     */
+    static void clear_deleteme_list_at_exit_capsule(PyObject* capsule);
+
 public:
 
+    /**
+     * Arrange for the greenlets still in our deleteme list when our
+     * thread exits to be killed in this thread, as it exits.
+     *
+     * The Python thread state's dictionary is cleared in its own
+     * thread, while Python code can still run there, but after the
+     * last switch this thread will make. If we didn't kill them then,
+     * they would have to be thrown away without unwinding when we're
+     * destroyed, stranding whatever their stacks refer to (in
+     * particular, the main greenlet they switched to).
+     */
+    void clear_deleteme_list_at_exit();
+
     /**
      * Returns a new reference, or a false object.
      */
@@ -299,6 +491,11 @@ public:
         return tracefunc;
     };
 
+    inline bool has_tracefunc() const
+    {
+        return !!this->tracefunc;
+    }
+
 
     inline void set_tracefunc(BorrowedObject tracefunc)
     {
@@ -311,6 +508,115 @@ public:
         }
     }
 
+    inline void set_native_trace(PyGreenlet_TraceFunc func, void* context, int mask)
+    {
+        this->native_trace = func;
+        this->native_trace_context = func ? context : nullptr;
+        this->native_trace_mask = func ? mask : 0;
+    }
+
+    inline SwitchLog* borrow_switch_log() const
+    {
+        return this->switch_log.get();
+    }
+
+    /**
+     * Start recording switches in *log*, which we take ownership of,
+     * or stop if it is null. Any previous log is discarded.
+     */
+    inline void set_switch_log(SwitchLog* log)
+    {
+        this->switch_log.reset(log);
+    }
+
+    inline SwitchTiming* borrow_switch_timing() const
+    {
+        return this->switch_timing.get();
+    }
+
+    /**
+     * Start timing switches in *timing*, which we take ownership
+     * of, or stop if it is null. Any previous histograms are
+     * discarded.
+     */
+    inline void set_switch_timing(SwitchTiming* timing)
+    {
+        this->switch_timing.reset(timing);
+    }
+
+    inline StallWatch* borrow_stall_watch() const
+    {
+        return this->stall_watch.get();
+    }
+
+    /**
+     * Replace our watch (stopping the old one). Must hold the GIL.
+     */
+    inline void set_stall_watch(const std::shared_ptr<StallWatch>& watch)
+    {
+        if (this->stall_watch) {
+            this->stall_watch->stop();
+        }
+        this->stall_watch = watch;
+    }
+
+    /**
+     * Called when our thread exits, possibly without the GIL, so the
+     * watchdog doesn't mistake that for a stall.
+     */
+    inline void thread_exiting() const
+    {
+        if (this->stall_watch) {
+            this->stall_watch->stopped = true;
+        }
+    }
+
+    inline bool accounting() const
+    {
+        return this->account_run_time;
+    }
+
+    /**
+     * The CPU clock to give Accounting, or 0 if we're not measuring
+     * CPU time.
+     */
+    inline uint64_t accounting_cpu_now() const
+    {
+        return this->account_cpu_time ? Accounting::thread_cpu_ns() : 0;
+    }
+
+    /**
+     * Start or stop accounting. The current greenlet's clock starts
+     * (or stops) now; the others' start when they're switched in.
+     * That doesn't count as switching the current greenlet in.
+     */
+    inline void set_accounting(bool enabled, bool cpu_time)
+    {
+        Accounting& current = this->current_greenlet->accounting();
+        current.stop(Accounting::monotonic_ns(), this->accounting_cpu_now());
+        this->account_run_time = enabled;
+        this->account_cpu_time = enabled && cpu_time;
+        if (enabled) {
+            current.start(Accounting::monotonic_ns(), this->accounting_cpu_now());
+        }
+    }
+
+    inline bool has_native_trace() const
+    {
+        return this->native_trace_mask != 0;
+    }
+
+    /**
+     * Report *event* to the native trace function, if it wants it.
+     * This runs no Python code and can't fail.
+     */
+    inline void call_native_trace(int event, PyGreenlet* origin, PyGreenlet* target) const
+    {
+        if (this->native_trace_mask & event) {
+            this->native_trace(event, origin, target, this->native_trace_context);
+        }
+    }
+
     /**
      * Given a reference to a greenlet that some other thread
      * attempted to delete (has a refcount of 0) store it for later
@@ -319,19 +625,186 @@ public:
     inline void delete_when_thread_running(PyGreenlet* to_del)
     {
         Py_INCREF(to_del);
-        this->deleteme.push_back(to_del);
+        PyGreenlet* head = this->deleteme.load(std::memory_order_relaxed);
+        do {
+            to_del->pimpl->_deleteme_next = head;
+        } while (!this->deleteme.compare_exchange_weak(head, to_del,
+                                                       std::memory_order_release,
+                                                       std::memory_order_relaxed));
+        if (!head && this->is_main_thread) {
+            // The list just became non-empty. Normally it's cleared
+            // the next time this thread switches greenlets, but a
+            // thread that's busy doing something else (or sleeping in
+            // a C call) may not do that for a long time; have the
+            // interpreter nudge it, so it can call its switch wakeup.
+            // Other threads can't be nudged this way. If this fails
+            // (the queue is full), the next switch still gets it.
+            Py_AddPendingCall(ThreadState::clear_deleteme_list_pending, nullptr);
+        }
+    }
+
+    /**
+     * Queue *pending*, which we take ownership of, to be performed
+     * the next time this thread runs its pending switches. Any thread
+     * may call this, holding the GIL.
+     *
+     * Returns a new reference to the wakeup callable if this thread
+     * had nothing waiting and one is set. It's up to the caller to
+     * call it, and not to touch this object afterwards: calling
+     * Python code could let our thread exit and destroy us.
+     */
+    inline OwnedObject push_pending_switch(PendingSwitch* pending)
+    {
+        PendingSwitch* head = this->pending_switches.load(std::memory_order_relaxed);
+        do {
+            pending->next = head;
+        } while (!this->pending_switches.compare_exchange_weak(head, pending,
+                                                               std::memory_order_release,
+                                                               std::memory_order_relaxed));
+        if (head || this->ready_switches) {
+            return OwnedObject();
+        }
+        return this->switch_wakeup;
     }
 
     /**
-     * Set to std::clock_t(-1) to disable.
+     * Remove and return the oldest switch waiting for this thread,
+     * or null. The caller owns it. Only for this thread.
      */
-    inline static std::clock_t& clocks_used_doing_gc()
+    inline PendingSwitch* take_pending_switch()
+    {
+        if (!this->ready_switches
+            && this->pending_switches.load(std::memory_order_relaxed)) {
+            PendingSwitch* pushed = this->pending_switches.exchange(nullptr,
+                                                                    std::memory_order_acquire);
+            while (pushed) {
+                PendingSwitch* const next = pushed->next;
+                pushed->next = this->ready_switches;
+                this->ready_switches = pushed;
+                pushed = next;
+            }
+        }
+        PendingSwitch* const result = this->ready_switches;
+        if (result) {
+            this->ready_switches = result->next;
+            result->next = nullptr;
+        }
+        return result;
+    }
+
+    inline OwnedObject get_switch_wakeup() const
     {
-        return ThreadState::_clocks_used_doing_gc;
+        return this->switch_wakeup;
+    }
+
+    inline void set_switch_wakeup(BorrowedObject wakeup)
+    {
+        assert(wakeup);
+        if (wakeup == BorrowedObject(Py_None)) {
+            this->switch_wakeup.CLEAR();
+        }
+        else {
+            this->switch_wakeup = wakeup;
+        }
+    }
+
+    inline void add_live_greenlet(LiveLink& link)
+    {
+        link.link(this->live_greenlets);
+    }
+
+    /**
+     * Appends new references to our main greenlet, and then each of
+     * our greenlets that has started and not finished, to *result*.
+     * Doesn't run any Python code.
+     */
+    void get_live_greenlets(std::vector<OwnedGreenlet>& result) const
+    {
+        if (this->main_greenlet) {
+            result.push_back(this->main_greenlet->self());
+        }
+        for (const LiveLink* link = this->live_greenlets.next;
+             link != &this->live_greenlets;
+             link = link->next) {
+            // Skip anything in the middle of being deallocated.
+            if (Py_REFCNT(link->greenlet->self().borrow())) {
+                result.push_back(link->greenlet->self());
+            }
+        }
+    }
+
+    /**
+     * Returns the state of the thread with the ident *thread_id*, or
+     * nullptr if it has none. Must be holding the GIL.
+     */
+    static ThreadState* find(unsigned long thread_id)
+    {
+        for (ThreadState* state = ThreadState::all_states; state; state = state->next_state) {
+            if (state->thread_id == thread_id) {
+                return state;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * As for get_live_greenlets(), but for every thread.
+     */
+    static void get_all_live_greenlets(std::vector<OwnedGreenlet>& result)
+    {
+        for (ThreadState* state = ThreadState::all_states; state; state = state->next_state) {
+            state->get_live_greenlets(result);
+        }
+    }
+
+    inline SwitchStats& stats()
+    {
+        return this->_stats;
+    }
+
+    /**
+     * Adds the counters of every thread, including those that are
+     * gone, to *total*, and returns how many thread states exist.
+     * Must be holding the GIL.
+     */
+    static size_t add_process_stats(SwitchStats& total)
+    {
+        size_t count = 0;
+        total += ThreadState::retired_stats;
+        for (ThreadState* state = ThreadState::all_states; state; state = state->next_state) {
+            total += state->_stats;
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * Zeroes the counters of every thread. Must be holding the GIL.
+     */
+    static void reset_process_stats()
+    {
+        ThreadState::retired_stats = SwitchStats();
+        for (ThreadState* state = ThreadState::all_states; state; state = state->next_state) {
+            state->_stats = SwitchStats();
+        }
     }
 
     ~ThreadState()
     {
+        if (this->prev_state) {
+            this->prev_state->next_state = this->next_state;
+        }
+        else {
+            ThreadState::all_states = this->next_state;
+        }
+        if (this->next_state) {
+            this->next_state->prev_state = this->prev_state;
+        }
+        // Our greenlets can no longer be found through us.
+        while (this->live_greenlets.next != &this->live_greenlets) {
+            this->live_greenlets.next->unlink();
+        }
+
         if (!PyInterpreterState_Head()) {
             // We shouldn't get here (our callers protect us)
             // but if we do, all we can do is bail early.
@@ -344,85 +817,46 @@ public:
         //assert(!this->switching_state.origin);
 
         this->tracefunc.CLEAR();
+        this->set_stall_watch(nullptr);
 
         // Forcibly GC as much as we can.
         this->clear_deleteme_list(true);
 
+        // Switches queued for us can never happen now. Dropping them
+        // may run arbitrary code, but can't queue any more: our main
+        // greenlet no longer knows about us.
+        this->switch_wakeup.CLEAR();
+        while (PendingSwitch* const pending = this->take_pending_switch()) {
+            delete pending;
+        }
+
         // The pending call did this.
         assert(this->main_greenlet->thread_state() == nullptr);
 
         // If the main greenlet is the current greenlet,
         // then we "fell off the end" and the thread died.
-        // It's possible that there is some other greenlet that
-        // switched to us, leaving a reference to the main greenlet
-        // on the stack, somewhere uncollectible. Try to detect that.
         if (this->current_greenlet == this->main_greenlet && this->current_greenlet) {
             assert(this->current_greenlet->is_currently_running_in_some_thread());
-            // Drop one reference we hold.
+            // Drop both of our references. Anything else that still
+            // refers to the main greenlet keeps it alive, but it no
+            // longer belongs to any thread or holds anything of the
+            // thread's, so it's small and inert.
+            //
+            // One such reference may be stranded on the stack of a
+            // greenlet that was suspended in something like
+            // ``getcurrent().parent.switch()`` and thrown away without
+            // unwinding; nothing can ever reach that to release it.
+            // Greenlets that were deleted while the thread was alive
+            // were killed in it as it exited (see
+            // clear_deleteme_list_at_exit()), so that only happens to
+            // greenlets that are still referenced when the thread
+            // exits. (We used to search the whole heap with
+            // ``gc.get_referrers()`` for that case, but that's
+            // proportional to the number of live objects and stalled
+            // whichever thread ran this for every thread that exited.)
             this->current_greenlet.CLEAR();
             assert(!this->current_greenlet);
-            // Only our reference to the main greenlet should be left,
-            // But hold onto the pointer in case we need to do extra cleanup.
-            PyGreenlet* old_main_greenlet = this->main_greenlet.borrow();
-            Py_ssize_t cnt = this->main_greenlet.REFCNT();
             this->main_greenlet.CLEAR();
-            if (ThreadState::_clocks_used_doing_gc != std::clock_t(-1)
-                && cnt == 2 && Py_REFCNT(old_main_greenlet) == 1) {
-                // Highly likely that the reference is somewhere on
-                // the stack, not reachable by GC. Verify.
-                // XXX: This is O(n) in the total number of objects.
-                // TODO: Add a way to disable this at runtime, and
-                // another way to report on it.
-                std::clock_t begin = std::clock();
-                NewReference gc(PyImport_ImportModule("gc"));
-                if (gc) {
-                    OwnedObject get_referrers = gc.PyRequireAttr(ThreadState::get_referrers_name);
-                    OwnedList refs(get_referrers.PyCall(old_main_greenlet));
-                    if (refs && refs.empty()) {
-                        assert(refs.REFCNT() == 1);
-                        // We found nothing! So we left a dangling
-                        // reference: Probably the last thing some
-                        // other greenlet did was call
-                        // 'getcurrent().parent.switch()' to switch
-                        // back to us. Clean it up. This will be the
-                        // case on CPython 3.7 and newer, as they use
-                        // an internal calling conversion that avoids
-                        // creating method objects and storing them on
-                        // the stack.
-                        Py_DECREF(old_main_greenlet);
-                    }
-                    else if (refs
-                             && refs.size() == 1
-                             && PyCFunction_Check(refs.at(0))
-                             && Py_REFCNT(refs.at(0)) == 2) {
-                        assert(refs.REFCNT() == 1);
-                        // Ok, we found a C method that refers to the
-                        // main greenlet, and its only referenced
-                        // twice, once in the list we just created,
-                        // once from...somewhere else. If we can't
-                        // find where else, then this is a leak.
-                        // This happens in older versions of CPython
-                        // that create a bound method object somewhere
-                        // on the stack that we'll never get back to.
-                        if (PyCFunction_GetFunction(refs.at(0).borrow()) == (PyCFunction)green_switch) {
-                            BorrowedObject function_w = refs.at(0);
-                            refs.clear(); // destroy the reference
-                                          // from the list.
-                            // back to one reference. Can *it* be
-                            // found?
-                            assert(function_w.REFCNT() == 1);
-                            refs = get_referrers.PyCall(function_w);
-                            if (refs && refs.empty()) {
-                                // Nope, it can't be found so it won't
-                                // ever be GC'd. Drop it.
-                                Py_CLEAR(function_w);
-                            }
-                        }
-                    }
-                    std::clock_t end = std::clock();
-                    ThreadState::_clocks_used_doing_gc += (end - begin);
-                }
-            }
         }
 
         // We need to make sure this greenlet appears to be dead,
@@ -456,13 +890,42 @@ public:
             PyErr_Clear();
         }
 
+        // Including whatever tearing down just counted.
+        ThreadState::retired_stats += this->_stats;
     }
 
 };
 
-ImmortalString ThreadState::get_referrers_name(nullptr);
 PythonAllocator<ThreadState> ThreadState::allocator;
-std::clock_t ThreadState::_clocks_used_doing_gc(0);
+ThreadState* ThreadState::all_states(nullptr);
+SwitchStats ThreadState::retired_stats;
+
+// The ThreadState of the running thread, once it has been created by
+// the ThreadStateCreator, which also clears it when it is destroyed.
+// Because this is a plain pointer with a constant initializer (unlike
+// the ThreadStateCreator, which has a constructor and destructor),
+// reading it doesn't go through the compiler's thread_local
+// initialization wrapper.
+static thread_local ThreadState* g_thread_state_cache G_TLS_INITIAL_EXEC = nullptr;
+
+void
+ThreadState::clear_deleteme_list_at_exit()
+{
+    PyErrPieces saved_err;
+    PyObject* const dict = PyThreadState_GetDict(); // borrowed
+    if (dict) {
+        const OwnedObject capsule = OwnedObject::consuming(
+            PyCapsule_New(this, "greenlet.ThreadState",
+                          ThreadState::clear_deleteme_list_at_exit_capsule));
+        // Without it, the list is still cleared (by murdering its
+        // members) when we're destroyed.
+        if (!capsule
+            || PyDict_SetItemString(dict, "greenlet.ThreadState", capsule.borrow()) < 0) {
+            PyErr_WriteUnraisable(nullptr);
+        }
+    }
+    saved_err.PyErrRestore();
+}
 
 template<typename Destructor>
 class ThreadStateCreator
@@ -484,7 +947,9 @@ public:
     {
         ThreadState* tmp = this->_state;
         this->_state = nullptr;
+        g_thread_state_cache = nullptr;
         if (tmp && tmp != (ThreadState*)1) {
+            tmp->thread_exiting();
             Destructor x(tmp);
         }
     }
@@ -501,10 +966,8 @@ public:
         if (this->_state == (ThreadState*)1) {
             // XXX: Assuming allocation never fails
             this->_state = new ThreadState;
-            // For non-standard threading, we need to store an object
-            // in the Python thread state dictionary so that it can be
-            // DECREF'd when the thread ends (ideally; the dict could
-            // last longer) and clean this object up.
+            g_thread_state_cache = this->_state;
+            this->_state->clear_deleteme_list_at_exit();
         }
         if (!this->_state) {
             throw std::runtime_error("Accessing state after destruction.");
@@ -536,7 +999,9 @@ public:
 // We can't use the PythonAllocator for this, because we push to it
 // from the thread state destructor, which doesn't have the GIL,
 // and Python's allocators can only be called with the GIL.
-typedef std::vector<ThreadState*> cleanup_queue_t;
+// Each entry remembers when it was queued.
+typedef std::pair<ThreadState*, std::chrono::steady_clock::time_point> cleanup_queue_item_t;
+typedef std::deque<cleanup_queue_item_t> cleanup_queue_t;
 
 }; // namespace greenlet
 
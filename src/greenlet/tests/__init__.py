@@ -7,12 +7,15 @@ from __future__ import absolute_import
 from __future__ import division
 from __future__ import print_function
 
+import os
 import sys
 import unittest
 
 from gc import collect
 from gc import get_objects
+from threading import Thread
 from threading import active_count as active_thread_count
+from time import perf_counter
 from time import sleep
 from time import time
 
@@ -235,3 +238,52 @@ class TestCase(TestCaseMetaClass(
             exitcodes = self.get_expected_returncodes_for_aborted_process()
         self.assertIn(exc.exception.returncode, exitcodes)
         return exc.exception
+
+
+def suspend():
+    getcurrent().parent.switch()
+
+
+def spin(seconds):
+    """
+    Run for *seconds* without switching or releasing the GIL.
+    """
+    end = perf_counter() + seconds
+    while perf_counter() < end:
+        pass
+
+
+def in_new_thread(func):
+    """
+    Return what *func* returns when called in a new thread. That
+    thread starts from a clean slate, without the greenlets other
+    tests may have left suspended in this one.
+    """
+    results = []
+    t = Thread(target=lambda: results.append(func()))
+    t.start()
+    t.join(10)
+    return results[0]
+
+
+def in_child_process(func):
+    """
+    Fork, and return the exit status of a child that calls *func* and
+    exits with what it returns.
+    """
+    pid = os.fork()
+    if not pid:
+        status = 99
+        try:
+            status = func()
+        finally:
+            os._exit(status)
+    deadline = time() + 10
+    while time() < deadline:
+        done, status = os.waitpid(pid, os.WNOHANG)
+        if done:
+            return os.WEXITSTATUS(status) if os.WIFEXITED(status) else -1
+        sleep(0.01)
+    os.kill(pid, 9)
+    os.waitpid(pid, 0)
+    return 'hung'
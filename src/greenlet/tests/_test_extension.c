@@ -71,6 +71,19 @@ test_getcurrent(PyObject* self)
     Py_RETURN_NONE;
 }
 
+static PyObject*
+test_getcurrent_borrowed(PyObject* self)
+{
+    PyGreenlet* g = PyGreenlet_GetCurrentBorrowed();
+    if (g == NULL || !PyGreenlet_Check(g)) {
+        PyErr_SetString(PyExc_AssertionError,
+                        "getcurrent() returned an invalid greenlet");
+        return NULL;
+    }
+    Py_INCREF(g);
+    return (PyObject*)g;
+}
+
 static PyObject*
 test_setparent(PyObject* self, PyObject* arg)
 {
@@ -162,6 +175,95 @@ test_throw_exact(PyObject* self, PyObject* args)
     Py_RETURN_NONE;
 }
 
+static PyObject*
+test_switch_threadsafe(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyGreenlet* g = NULL;
+    PyObject* switch_args = NULL;
+
+    if (!PyArg_ParseTuple(args, "O|O!:switch_threadsafe", &g, &PyTuple_Type, &switch_args)) {
+        return NULL;
+    }
+
+    if (PyGreenlet_SwitchThreadsafe(g, switch_args, kwargs) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+test_throw_threadsafe(PyObject* self, PyGreenlet* g)
+{
+    const char msg[] = "take that sucka!";
+    PyObject* msg_obj = Py_BuildValue("s", msg);
+    int result = PyGreenlet_ThrowThreadsafe(g, PyExc_ValueError, msg_obj, NULL);
+    Py_DECREF(msg_obj);
+    if (result < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+#define MAX_TRACE_EVENTS 32
+
+static struct {
+    int event;
+    PyGreenlet* origin;
+    PyGreenlet* target;
+} trace_events[MAX_TRACE_EVENTS];
+
+static void
+record_trace_event(int event, PyGreenlet* origin, PyGreenlet* target, void* context)
+{
+    int* count = (int*)context;
+    if (*count < MAX_TRACE_EVENTS) {
+        Py_INCREF(origin);
+        Py_INCREF(target);
+        trace_events[*count].event = event;
+        trace_events[*count].origin = origin;
+        trace_events[*count].target = target;
+    }
+    (*count)++;
+}
+
+static PyObject*
+test_native_trace(PyObject* self, PyObject* args)
+{
+    PyObject* func = NULL;
+    int mask = PyGreenlet_TRACE_ALL;
+    int count = 0;
+    PyObject* result;
+    PyObject* events;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "O|i:native_trace", &func, &mask)) {
+        return NULL;
+    }
+    if (PyGreenlet_SetNativeTrace(record_trace_event, &count, mask) < 0) {
+        return NULL;
+    }
+    result = PyObject_CallObject(func, NULL);
+    PyGreenlet_SetNativeTrace(NULL, NULL, 0);
+
+    events = PyList_New(0);
+    for (i = 0; i < count && i < MAX_TRACE_EVENTS; i++) {
+        PyObject* item = Py_BuildValue("(iNN)",
+                                       trace_events[i].event,
+                                       (PyObject*)trace_events[i].origin,
+                                       (PyObject*)trace_events[i].target);
+        if (events && item) {
+            PyList_Append(events, item);
+        }
+        Py_XDECREF(item);
+    }
+    if (!result) {
+        Py_XDECREF(events);
+        return NULL;
+    }
+    Py_DECREF(result);
+    return events;
+}
+
 static PyMethodDef test_methods[] = {
     {"test_switch",
      (PyCFunction)test_switch,
@@ -176,6 +278,10 @@ static PyMethodDef test_methods[] = {
      (PyCFunction)test_getcurrent,
      METH_NOARGS,
      "Test PyGreenlet_GetCurrent()"},
+    {"test_getcurrent_borrowed",
+     (PyCFunction)test_getcurrent_borrowed,
+     METH_NOARGS,
+     "Return PyGreenlet_GetCurrentBorrowed()"},
     {"test_setparent",
      (PyCFunction)test_setparent,
      METH_O,
@@ -200,6 +306,21 @@ static PyMethodDef test_methods[] = {
      (PyCFunction)test_throw_exact,
      METH_VARARGS,
      "Throw exactly the arguments given at the provided greenlet"},
+    {"test_switch_threadsafe",
+     (PyCFunction)test_switch_threadsafe,
+     METH_VARARGS | METH_KEYWORDS,
+     "Queue a switch to the provided greenlet with the given tuple of\n"
+     "arguments, and the keyword args."},
+    {"test_throw_threadsafe",
+     (PyCFunction)test_throw_threadsafe,
+     METH_O,
+     "Queue throwing a ValueError at the provided greenlet"},
+    {"test_native_trace",
+     (PyCFunction)test_native_trace,
+     METH_VARARGS,
+     "Call the function with a native trace function installed for\n"
+     "the events in the mask, and return the (event, origin, target)\n"
+     "tuples it saw."},
     {NULL, NULL, 0, NULL}
 };
 
@@ -227,5 +348,12 @@ PyInit__test_extension(void)
     }
 
     PyGreenlet_Import();
+    if (PyModule_AddIntConstant(module, "TRACE_SWITCH", PyGreenlet_TRACE_SWITCH) < 0
+        || PyModule_AddIntConstant(module, "TRACE_THROW", PyGreenlet_TRACE_THROW) < 0
+        || PyModule_AddIntConstant(module, "TRACE_START", PyGreenlet_TRACE_START) < 0
+        || PyModule_AddIntConstant(module, "TRACE_FINISH", PyGreenlet_TRACE_FINISH) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
     return module;
 }
@@ -0,0 +1,108 @@
+"""
+Tests for the per-greenlet accounting enabled by
+``enable_accounting()``.
+"""
+import time
+
+import greenlet
+from greenlet import greenlet as RawGreenlet
+from . import TestCase
+from . import spin
+
+
+class AccountingTests(TestCase):
+
+    def tearDown(self):
+        greenlet.enable_accounting(False)
+        super(AccountingTests, self).tearDown()
+
+    def test_disabled_by_default(self):
+        glet = RawGreenlet(lambda: spin(0.01))
+        glet.switch()
+        self.assertEqual(glet.gr_switches, 0)
+        self.assertEqual(glet.gr_run_time, 0.0)
+        self.assertEqual(glet.gr_cpu_time, 0.0)
+        self.assertIsNone(glet.gr_last_switch_in)
+
+    def test_run_time_and_switches(self):
+        main = greenlet.getcurrent()
+        def run():
+            spin(0.02)
+            main.switch()
+            spin(0.02)
+        glet = RawGreenlet(run)
+        greenlet.enable_accounting()
+        main_switches = main.gr_switches
+        before = time.monotonic()
+        glet.switch()
+        self.assertEqual(glet.gr_switches, 1)
+        self.assertGreaterEqual(glet.gr_run_time, 0.02)
+        self.assertLess(glet.gr_run_time, 1)
+        first_switch_in = glet.gr_last_switch_in
+        main_run_time = main.gr_run_time
+        glet.switch()
+        self.assertTrue(glet.dead)
+        self.assertEqual(glet.gr_switches, 2)
+        self.assertGreaterEqual(glet.gr_run_time, 0.04)
+        self.assertGreater(glet.gr_last_switch_in, first_switch_in)
+        # On the clock of time.monotonic()
+        self.assertGreaterEqual(first_switch_in, before)
+        self.assertLessEqual(glet.gr_last_switch_in, time.monotonic())
+        # Main was switched into when each of them returned, and
+        # its time excludes theirs.
+        self.assertEqual(main.gr_switches - main_switches, 2)
+        self.assertLess(main.gr_run_time - main_run_time, 0.02)
+
+    def test_current_greenlet_includes_running_time(self):
+        greenlet.enable_accounting()
+        main = greenlet.getcurrent()
+        before = main.gr_run_time
+        spin(0.01)
+        self.assertGreaterEqual(main.gr_run_time - before, 0.01)
+        greenlet.enable_accounting(False)
+        stopped = main.gr_run_time
+        spin(0.01)
+        self.assertEqual(main.gr_run_time, stopped)
+
+    def test_enabling_is_not_a_switch(self):
+        main = greenlet.getcurrent()
+        greenlet.enable_accounting()
+        switches = main.gr_switches
+        switched_in = main.gr_last_switch_in
+        spin(0.01)
+        greenlet.enable_accounting()
+        greenlet.enable_accounting(False)
+        greenlet.enable_accounting()
+        self.assertEqual(main.gr_switches, switches)
+        if switched_in is None:
+            self.assertIsNone(main.gr_last_switch_in)
+        else:
+            # Both clocks are read each time, so allow for rounding.
+            self.assertAlmostEqual(main.gr_last_switch_in, switched_in, delta=0.005)
+        # The time from before it was re-enabled still counts.
+        self.assertGreaterEqual(main.gr_run_time, 0.01)
+
+    def test_cpu_time(self):
+        main = greenlet.getcurrent()
+        def sleeps():
+            time.sleep(0.05)
+            main.switch()
+        def spins():
+            spin(0.05)
+        sleeper = RawGreenlet(sleeps)
+        spinner = RawGreenlet(spins)
+        greenlet.enable_accounting(cpu_time=True)
+        sleeper.switch()
+        spinner.switch()
+        self.assertGreaterEqual(sleeper.gr_run_time, 0.05)
+        self.assertLess(sleeper.gr_cpu_time, 0.04)
+        if spinner.gr_cpu_time == 0.0: # pragma: no cover
+            self.skipTest("Thread CPU time not available")
+        self.assertGreater(spinner.gr_cpu_time, 0.02)
+
+    def test_no_cpu_time_unless_asked(self):
+        greenlet.enable_accounting()
+        glet = RawGreenlet(lambda: spin(0.01))
+        glet.switch()
+        self.assertGreater(glet.gr_run_time, 0)
+        self.assertEqual(glet.gr_cpu_time, 0.0)
@@ -0,0 +1,97 @@
+"""
+Tests for ``greenlet.dump_stacks()``.
+"""
+import sys
+import traceback
+
+import greenlet
+from greenlet import greenlet as RawGreenlet
+from . import TestCase
+from . import in_new_thread
+from . import suspend
+
+
+def recurse(depth):
+    if depth:
+        return recurse(depth - 1)
+    return suspend()
+
+
+def suspend_in_key(_item):
+    # Called from C by sorted().
+    suspend()
+    return 0
+
+
+def summary(frame):
+    return [(f.filename, f.lineno, f.name) for f in traceback.extract_stack(frame)]
+
+
+class DumpStacksTests(TestCase):
+
+    def _check_matches_gr_frame(self, run, *args):
+        glet = RawGreenlet(run)
+        glet.switch(*args)
+        try:
+            stacks = dict(greenlet.dump_stacks())
+            self.assertIn(id(glet), stacks)
+            self.assertEqual(stacks[id(glet)], summary(glet.gr_frame))
+            return stacks[id(glet)]
+        finally:
+            glet.throw()
+
+    def test_matches_gr_frame(self):
+        stack = self._check_matches_gr_frame(recurse, 5)
+        self.assertEqual([name for _, _, name in stack],
+                         ['recurse'] * 6 + ['suspend'])
+
+    def test_frames_entered_from_c(self):
+        stack = self._check_matches_gr_frame(lambda: sorted([1, 2], key=suspend_in_key))
+        self.assertEqual([name for _, _, name in stack][-3:],
+                         ['<lambda>', 'suspend_in_key', 'suspend'])
+
+    def test_only_suspended_greenlets(self):
+        def run():
+            main = greenlet.getcurrent()
+            unstarted = RawGreenlet(suspend)
+            finished = RawGreenlet(lambda: None)
+            finished.switch()
+            suspended = RawGreenlet(suspend)
+            suspended.switch()
+            stacks = greenlet.dump_stacks()
+            suspended.switch()
+            return main, unstarted, suspended, stacks
+        main, unstarted, suspended, stacks = in_new_thread(run)
+        self.assertEqual([ident for ident, _ in stacks], [id(suspended)])
+        self.assertNotIn(id(main), dict(stacks))
+        self.assertNotIn(id(unstarted), dict(stacks))
+
+    def test_main_greenlet_from_child(self):
+        def child():
+            return greenlet.dump_stacks()
+        def run():
+            main = greenlet.getcurrent()
+            switch_line = sys._getframe().f_lineno + 1
+            stacks = RawGreenlet(child).switch()
+            return main, switch_line, stacks
+        main, switch_line, stacks = in_new_thread(run)
+        self.assertEqual([ident for ident, _ in stacks], [id(main)])
+        filename, lineno, name = stacks[0][1][-1]
+        self.assertEqual(filename, __file__)
+        self.assertEqual(lineno, switch_line)
+        self.assertEqual(name, 'run')
+
+    def test_many_greenlets(self):
+        def run():
+            glets = [RawGreenlet(recurse) for _ in range(20)]
+            for depth, glet in enumerate(glets):
+                glet.switch(depth)
+            stacks = greenlet.dump_stacks()
+            expected = [(id(glet), summary(glet.gr_frame)) for glet in glets]
+            for glet in glets:
+                glet.switch()
+            return stacks, expected
+        stacks, expected = in_new_thread(run)
+        self.assertEqual(stacks, expected)
+        for depth, (_, stack) in enumerate(stacks):
+            self.assertEqual(len(stack), depth + 2)
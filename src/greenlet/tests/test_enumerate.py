@@ -0,0 +1,93 @@
+"""
+Tests for ``greenlet.enumerate()``.
+"""
+import threading
+
+import greenlet
+from greenlet import greenlet as RawGreenlet
+from . import TestCase
+from . import in_new_thread
+from . import suspend
+
+
+class EnumerateTests(TestCase):
+
+    def test_main_greenlet_only(self):
+        def run():
+            return greenlet.enumerate(), greenlet.getcurrent()
+        glets, main = in_new_thread(run)
+        self.assertEqual(glets, [main])
+
+    def test_live_greenlets_in_start_order(self):
+        def run():
+            main = greenlet.getcurrent()
+            first, second, unstarted = [RawGreenlet(suspend) for _ in range(3)]
+            second.switch()
+            first.switch()
+            live = greenlet.enumerate()
+            second.switch()
+            after_finish = greenlet.enumerate()
+            first.throw()
+            after_kill = greenlet.enumerate()
+            return (live == [main, second, first],
+                    after_finish == [main, first],
+                    after_kill == [main],
+                    unstarted)
+        live, after_finish, after_kill, _ = in_new_thread(run)
+        self.assertTrue(live)
+        self.assertTrue(after_finish)
+        self.assertTrue(after_kill)
+
+    def test_includes_current(self):
+        def run():
+            return greenlet.enumerate()[-1] is greenlet.getcurrent()
+        self.assertTrue(RawGreenlet(run).switch())
+
+    def test_deallocated_greenlets_removed(self):
+        def run():
+            glet = RawGreenlet(suspend)
+            glet.switch()
+            before = len(greenlet.enumerate())
+            del glet
+            return before, len(greenlet.enumerate())
+        self.assertEqual(in_new_thread(run), (2, 1))
+
+    def test_other_threads(self):
+        started = threading.Event()
+        done = threading.Event()
+        theirs = []
+        def run():
+            glet = RawGreenlet(suspend)
+            glet.switch()
+            theirs.extend([greenlet.getcurrent(), glet])
+            started.set()
+            done.wait(10)
+            # If it's still suspended when the thread exits, it
+            # strands a reference to our main greenlet.
+            glet.throw()
+        t = threading.Thread(target=run)
+        t.start()
+        try:
+            started.wait(10)
+            self.assertEqual(greenlet.enumerate(t.ident), theirs)
+            everything = greenlet.enumerate(all_threads=True)
+            for glet in theirs:
+                self.assertIn(glet, everything)
+            for glet in greenlet.enumerate():
+                self.assertIn(glet, everything)
+        finally:
+            done.set()
+            t.join(10)
+        del theirs[:]
+        self.wait_for_pending_cleanups()
+        self.assertEqual(greenlet.enumerate(t.ident), [])
+
+    def test_thread_without_greenlets(self):
+        t = threading.Thread(target=lambda: None)
+        t.start()
+        t.join(10)
+        self.assertEqual(greenlet.enumerate(t.ident), [])
+
+    def test_bad_thread(self):
+        with self.assertRaises(TypeError):
+            greenlet.enumerate('main')
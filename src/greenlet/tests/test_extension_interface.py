@@ -42,6 +42,12 @@ class CAPITests(TestCase):
     def test_getcurrent(self):
         _test_extension.test_getcurrent()
 
+    def test_getcurrent_borrowed(self):
+        self.assertIs(_test_extension.test_getcurrent_borrowed(),
+                      greenlet.getcurrent())
+        g = greenlet.greenlet(_test_extension.test_getcurrent_borrowed)
+        self.assertIs(g.switch(), g)
+
     def test_new_greenlet(self):
         self.assertEqual(-15, _test_extension.test_new_greenlet(lambda: -15))
 
@@ -110,6 +116,82 @@ class CAPITests(TestCase):
                          "exceptions must be classes, or instances, not str")
 
 
+    def test_switch_threadsafe(self):
+        seen = []
+        def run(*args, **kwargs):
+            seen.append((args, kwargs))
+            greenlet.getcurrent().parent.switch()
+            seen.append('resumed')
+        g = greenlet.greenlet(run)
+        self.assertIsNone(
+            _test_extension.test_switch_threadsafe(g, (1, 2), x=3))
+        self.assertEqual(seen, [])
+        self.assertEqual(greenlet.run_pending_switches(), 1)
+        self.assertEqual(seen, [((1, 2), {'x': 3})])
+        _test_extension.test_switch_threadsafe(g)
+        self.assertEqual(greenlet.run_pending_switches(), 1)
+        self.assertEqual(seen[-1], 'resumed')
+        self.assertTrue(g.dead)
+
+    def test_throw_threadsafe(self):
+        seen = []
+        def run():
+            try:
+                greenlet.getcurrent().parent.switch()
+            except ValueError as ex:
+                seen.append(ex)
+        g = greenlet.greenlet(run)
+        g.switch()
+        _test_extension.test_throw_threadsafe(g)
+        self.assertEqual(seen, [])
+        greenlet.run_pending_switches()
+        self.assertEqual([str(ex) for ex in seen], ['take that sucka!'])
+        self.assertTrue(g.dead)
+
+    def test_native_trace(self):
+        main = greenlet.getcurrent()
+        def run():
+            main.switch()
+        def throws():
+            try:
+                main.switch()
+            except ValueError:
+                pass
+        g = greenlet.greenlet(run)
+        g2 = greenlet.greenlet(throws)
+        g2.switch()
+        def body():
+            g.switch()
+            g.switch()
+            g2.throw(ValueError)
+        events = _test_extension.test_native_trace(body)
+        self.assertEqual(events, [
+            (_test_extension.TRACE_START, main, g),
+            (_test_extension.TRACE_SWITCH, g, main),
+            (_test_extension.TRACE_SWITCH, main, g),
+            (_test_extension.TRACE_FINISH, g, main),
+            (_test_extension.TRACE_THROW, main, g2),
+            (_test_extension.TRACE_FINISH, g2, main),
+        ])
+        self.assertTrue(g.dead)
+        self.assertTrue(g2.dead)
+
+    def test_native_trace_mask(self):
+        main = greenlet.getcurrent()
+        g = greenlet.greenlet(main.switch)
+        def body():
+            g.switch()
+            g.switch()
+        mask = _test_extension.TRACE_START | _test_extension.TRACE_FINISH
+        events = _test_extension.test_native_trace(body, mask)
+        self.assertEqual(events, [
+            (_test_extension.TRACE_START, main, g),
+            (_test_extension.TRACE_FINISH, g, main),
+        ])
+        with self.assertRaises(ValueError):
+            _test_extension.test_native_trace(body, 0x100)
+
+
 if __name__ == '__main__':
     import unittest
     unittest.main()
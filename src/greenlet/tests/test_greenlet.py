@@ -6,6 +6,7 @@ import gc
 import sys
 import time
 import threading
+import weakref
 
 from abc import ABCMeta, abstractmethod
 
@@ -267,6 +268,246 @@ class TestGreenlet(TestCase):
             del seen[:]
             del someref[:]
 
+    def test_dealloc_other_thread_main_thread_never_switches(self):
+        # A greenlet belonging to the main thread that's released in
+        # another thread is killed by a pending call, even though the
+        # main thread never switches or calls a greenlet API. Its
+        # switch wakeup is only for when that can't be done.
+        seen = []
+        woken = []
+        g = RawGreenlet(fmain)
+        g.switch(seen)
+        refs = [g]
+        del g
+
+        greenlet.set_switch_wakeup(lambda: woken.append(True))
+        try:
+            t = threading.Thread(target=refs.clear)
+            t.start()
+            t.join(10)
+            self.assertEqual(refs, [])
+
+            deadline = time.time() + 10
+            while not seen and time.time() < deadline:
+                time.sleep(0.001)
+            self.assertEqual(seen, [greenlet.GreenletExit])
+            self.assertEqual(woken, [])
+        finally:
+            greenlet.set_switch_wakeup(None)
+
+    def test_dealloc_other_thread_killed_by_getcurrent(self):
+        # A greenlet released in another thread is killed in its own
+        # thread the next time that thread calls getcurrent(), if it
+        # doesn't switch first.
+        seen = []
+        refs = []
+        released = threading.Event()
+        def worker():
+            g = RawGreenlet(fmain)
+            g.switch(seen)
+            refs.append(g)
+            del g
+            released.wait(10)
+            seen.append('released')
+            greenlet.getcurrent()
+            seen.append('getcurrent')
+        t = threading.Thread(target=worker)
+        t.start()
+        while not refs:
+            time.sleep(0.001)
+        del refs[:]
+        released.set()
+        t.join(10)
+        self.assertEqual(seen, ['released', greenlet.GreenletExit, 'getcurrent'])
+
+    def test_dealloc_other_thread_killed_as_thread_exits(self):
+        # If the thread never switches again, the greenlet is killed
+        # in it as it exits, unwinding its stack.
+        seen = []
+        refs = []
+        released = threading.Event()
+        def run():
+            try:
+                greenlet.getcurrent().parent.switch()
+            except greenlet.GreenletExit:
+                seen.append(threading.get_ident())
+                raise
+        def worker():
+            g = RawGreenlet(run)
+            g.switch()
+            refs.append(g)
+            del g
+            released.wait(10)
+        t = threading.Thread(target=worker)
+        t.start()
+        while not refs:
+            time.sleep(0.001)
+        main_wref = weakref.ref(refs[0].parent)
+        del refs[:]
+        released.set()
+        t.join(10)
+        self.assertEqual(seen, [t.ident])
+        self.wait_for_pending_cleanups()
+        self.assertIsNone(main_wref())
+
+    def test_dealloc_other_thread_traced_after_switch(self):
+        # Killing the released greenlet switches, but only once the
+        # switch that noticed it has been reported.
+        seen = []
+        refs = []
+        events = []
+        released = threading.Event()
+        def tracer(event, args):
+            events.append((event, args[0], args[1]))
+        def worker():
+            main = greenlet.getcurrent()
+            other = RawGreenlet(lambda: main.switch())
+            other.switch()
+            g = RawGreenlet(fmain)
+            g.switch(seen)
+            refs.append(g)
+            del g
+            released.wait(10)
+            greenlet.settrace(tracer)
+            try:
+                other.switch()
+            finally:
+                greenlet.settrace(None)
+            refs.append((main, other))
+        t = threading.Thread(target=worker)
+        t.start()
+        while not refs:
+            time.sleep(0.001)
+        del refs[:]
+        released.set()
+        t.join(10)
+        main, other = refs.pop()
+        self.assertEqual(seen, [greenlet.GreenletExit])
+        self.assertEqual(events[0], ('switch', main, other))
+        self.assertEqual(events[-1], ('switch', other, main))
+        # Each switch starts where the one before it went.
+        for before, after in zip(events, events[1:]):
+            self.assertIs(before[2], after[1])
+
+    def test_unstarted_greenlets_taken_by_other_threads(self):
+        # A greenlet that hasn't started has no stack or frames yet,
+        # so any thread can take it by giving it a parent of its own.
+        # That's how a pool of threads can share (steal) work. Once
+        # it starts, it belongs to that thread.
+        ran = []
+        def task(i):
+            ran.append((i, threading.get_ident()))
+            self.assertEqual(greenlet.getcurrent().parent.switch(), 'resumed')
+            return i
+
+        work = [RawGreenlet(task) for _ in range(20)]
+        self.assertTrue(all(glet.parent is greenlet.getcurrent() for glet in work))
+        queue = list(enumerate(work))
+        results = []
+        started = []
+        def worker():
+            while True:
+                try:
+                    i, glet = queue.pop()
+                except IndexError:
+                    break
+                glet.parent = greenlet.getcurrent()
+                glet.switch(i)
+                started.append(glet)
+                results.append(glet.switch('resumed'))
+
+        threads = [threading.Thread(target=worker) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join(10)
+
+        self.assertEqual(sorted(results), list(range(20)))
+        self.assertEqual(len(ran), 20)
+        self.assertNotIn(threading.get_ident(), {ident for _, ident in ran})
+        self.assertTrue(all(glet.dead for glet in work))
+
+        # A started greenlet can't be taken.
+        glet = RawGreenlet(lambda: greenlet.getcurrent().parent.switch())
+        glet.switch()
+        def take():
+            with self.assertRaises(ValueError):
+                glet.parent = greenlet.getcurrent()
+            started.append(True)
+        t = threading.Thread(target=take)
+        t.start()
+        t.join(10)
+        self.assertIs(started[-1], True)
+        glet.switch()
+        del work[:]
+        del started[:]
+
+    def test_subinterpreter(self):
+        # Interpreters that share the main GIL each get their own
+        # module object. Do this in a fresh process so we don't mix up
+        # the thread state of the interpreter running the tests.
+        try:
+            import _testcapi # pylint:disable=unused-import
+        except ImportError:
+            self.skipTest("Needs _testcapi")
+        import subprocess
+        script = '''
+import _testcapi
+code = """
+import greenlet
+g = greenlet.greenlet(lambda: greenlet.getcurrent().parent.switch(42))
+assert g.switch() == 42
+g.switch()
+assert g.dead
+"""
+assert _testcapi.run_in_subinterp(code) == 0
+assert _testcapi.run_in_subinterp(code) == 0
+import greenlet
+assert greenlet.greenlet(lambda: 42).switch() == 42
+print("OK")
+'''
+        output = subprocess.check_output([sys.executable, '-c', script],
+                                         encoding='utf-8',
+                                         stderr=subprocess.STDOUT)
+        self.assertEqual(output.strip(), 'OK')
+
+    def test_subinterpreter_checking_extensions(self):
+        # Our thread states are shared by all interpreters, so
+        # interpreters that ask aren't allowed to import us.
+        try:
+            from _testcapi import run_in_subinterp_with_config
+        except ImportError:
+            self.skipTest("Needs _testcapi.run_in_subinterp_with_config")
+        if sys.version_info[:2] != (3, 12):
+            self.skipTest("Uses the 3.12 signature")
+        import subprocess
+        script = '''
+import _testcapi
+code = """
+try:
+    import greenlet
+except ImportError:
+    pass
+else:
+    raise AssertionError("imported")
+"""
+assert _testcapi.run_in_subinterp_with_config(
+    code,
+    use_main_obmalloc=True,
+    allow_fork=True,
+    allow_exec=True,
+    allow_threads=True,
+    allow_daemon_threads=True,
+    check_multi_interp_extensions=True,
+    gil=1, # Shared
+) == 0
+print("OK")
+'''
+        output = subprocess.check_output([sys.executable, '-c', script],
+                                         encoding='utf-8',
+                                         stderr=subprocess.STDOUT)
+        self.assertEqual(output.strip(), 'OK')
+
     def test_frame(self):
         def f1():
             f = sys._getframe(0) # pylint:disable=protected-access
@@ -893,6 +1134,70 @@ class TestGreenlet(TestCase):
         self.assertIsNone(frame.f_back)
         self.assertEqual(gr.switch(10), 1200)  # 1200 = 5! * 10
 
+    def test_get_stack_with_nested_c_calls_after_resuming(self):
+        # On 3.12+, frames that stay suspended across several switches
+        # are only exposed once; make sure the whole stack stays
+        # correct as the greenlet returns and makes new calls in between.
+        from functools import partial
+        from . import _test_extension_cpp
+
+        def inner(n):
+            if n > 0:
+                return _test_extension_cpp.test_call(partial(inner, n - 1))
+            return greenlet.getcurrent().parent.switch()
+
+        def recurse(v, depths):
+            if v > 0:
+                return _test_extension_cpp.test_call(partial(recurse, v - 1, depths))
+            for depth in depths:
+                inner(depth)
+            return None
+
+        depths = (0, 0, 2, 4, 4, 1, 0, 3)
+        gr = RawGreenlet(recurse)
+        gr.switch(3, depths)
+        for depth in depths:
+            # Clobber the part of the C stack that was used by ``gr``.
+            RawGreenlet(lambda: None).switch()
+            frame = gr.gr_frame
+            for i in range(depth + 1):
+                self.assertEqual(frame.f_locals["n"], i)
+                frame = frame.f_back
+            for i in range(4):
+                self.assertEqual(frame.f_locals["v"], i)
+                frame = frame.f_back
+            self.assertIsNone(frame)
+            gr.switch()
+        self.assertTrue(gr.dead)
+
+    def test_get_stack_when_frame_objects_are_reused(self):
+        # Each call to ``step`` gets the frame, and usually the frame
+        # object, that the previous call just released. They must not
+        # be mistaken for the frames we exposed last time.
+        from functools import partial
+        from . import _test_extension_cpp
+
+        def step(n):
+            sys._getframe()
+            return greenlet.getcurrent().parent.switch()
+
+        def loop(count):
+            for n in range(count):
+                if n % 2:
+                    _test_extension_cpp.test_call(partial(step, n))
+                else:
+                    step(n)
+
+        gr = RawGreenlet(loop)
+        gr.switch(6)
+        for n in range(6):
+            frame = gr.gr_frame
+            self.assertEqual(frame.f_locals["n"], n)
+            self.assertEqual(frame.f_back.f_code, loop.__code__)
+            self.assertIsNone(frame.f_back.f_back)
+            gr.switch()
+        self.assertTrue(gr.dead)
+
     def test_frames_always_exposed(self):
         # On Python 3.12 this will crash if we don't set the
         # gr_frames_always_exposed attribute. More background:
@@ -1088,6 +1393,35 @@ class TestGreenletSetParentErrors(TestCase):
             g3.parent = g1
         self.assertEqual(str(exc.exception), "cyclic parent chain")
 
+    def test_deep_chain_after_reparenting(self):
+        # What a greenlet knows about its parent chain is cached;
+        # reparenting anything in the chain must be noticed.
+        chain = [RawGreenlet(lambda *_args: 42)]
+        for _ in range(2000):
+            chain.append(RawGreenlet(lambda *_args: 42, parent=chain[-1]))
+        root, middle, leaf = chain[0], chain[1000], chain[-1]
+
+        with self.assertRaises(ValueError) as exc:
+            root.parent = leaf
+        self.assertEqual(str(exc.exception), "cyclic parent chain")
+        # Not a cycle, just deeper.
+        leaf.parent = middle
+
+        other = []
+        t = threading.Thread(target=lambda: other.append(RawGreenlet(lambda: None)))
+        t.start()
+        t.join(10)
+        root.parent = other[0]
+        with self.assertRaises(greenlet.error) as exc:
+            leaf.switch()
+        self.assertIn("cannot switch to a different thread", str(exc.exception))
+
+        root.parent = greenlet.getcurrent()
+        self.assertEqual(leaf.switch(), 42)
+        with self.assertRaises(ValueError) as exc:
+            root.parent = middle
+        self.assertEqual(str(exc.exception), "cyclic parent chain")
+
 
 class TestRepr(TestCase):
 
@@ -10,11 +10,11 @@ import gc
 import time
 import weakref
 import threading
+import unittest
 
 
 import greenlet
 from . import TestCase
-from .leakcheck import fails_leakcheck
 from .leakcheck import ignores_leakcheck
 from .leakcheck import RUNNING_ON_MANYLINUX
 
@@ -59,6 +59,28 @@ class TestLeaks(TestCase):
             g.switch(**kwargs)
         self.assertEqual(sys.getrefcount(kwargs), 2)
 
+    @unittest.skipUnless(hasattr(greenlet._greenlet, 'get_refcount_operations'),
+                         "Only debug builds count reference operations")
+    def test_switch_moves_references(self):
+        # Arguments, results and the origin greenlet are moved along
+        # the switch path instead of being copied. Each switch only
+        # needs to take a reference to the new current greenlet,
+        # release its arguments (the tuple and the item we return),
+        # and drop the origin once it's been traced.
+        get_refcount_operations = greenlet._greenlet.get_refcount_operations
+        def run():
+            parent = greenlet.getcurrent().parent
+            while True:
+                parent.switch(1)
+
+        g = greenlet.greenlet(run)
+        g.switch()
+        before = get_refcount_operations()
+        for _ in range(100):
+            g.switch()
+        per_round_trip = (get_refcount_operations() - before) / 100.0
+        self.assertLessEqual(per_round_trip, 8)
+
 
     @staticmethod
     def __recycle_threads():
@@ -93,6 +115,49 @@ class TestLeaks(TestCase):
         for g in gg:
             self.assertIsNone(g())
 
+    def test_thread_state_cleanup_budget(self):
+        # With a budget of one thread state per pass, a burst of
+        # exiting threads is destroyed over several passes, picking
+        # up leftovers the next times we call getcurrent(), even
+        # though we never switch.
+        stats_before = greenlet._greenlet.get_cleanup_stats()
+        greenlet._greenlet.set_cleanup_budget(max_count=1)
+        try:
+            exit_now = threading.Event()
+            def worker():
+                greenlet.getcurrent()
+                exit_now.wait(10)
+            threads = [threading.Thread(target=worker) for _ in range(5)]
+            for t in threads:
+                t.start()
+            exit_now.set()
+            for t in threads:
+                t.join(10)
+            del t, threads
+
+            deadline = time.time() + 10
+            while (greenlet._greenlet.get_cleanup_stats()['destroyed']
+                   < stats_before['destroyed'] + 5
+                   and time.time() < deadline):
+                greenlet.getcurrent()
+                time.sleep(0.001)
+        finally:
+            greenlet._greenlet.set_cleanup_budget()
+
+        stats = greenlet._greenlet.get_cleanup_stats()
+        self.assertEqual(stats['pending'], 0)
+        self.assertEqual(stats['destroyed'], stats_before['destroyed'] + 5)
+        self.assertEqual(stats['passes'], stats_before['passes'] + 5)
+        self.assertGreaterEqual(stats['max_pending'], 1)
+        self.assertGreater(stats['total_time_ns'], stats_before['total_time_ns'])
+        self.assertGreaterEqual(stats['max_latency_ns'], 0)
+
+    def test_thread_state_cleanup_budget_validates(self):
+        with self.assertRaises(ValueError):
+            greenlet._greenlet.set_cleanup_budget(max_count=-1)
+        with self.assertRaises(TypeError):
+            greenlet._greenlet.set_cleanup_budget(max_time=1)
+
     def test_threaded_adv_leak(self):
         gg = []
         def worker():
@@ -261,37 +326,22 @@ class TestLeaks(TestCase):
         finally:
             greenlet._greenlet.enable_optional_cleanup(True)
 
-    @fails_leakcheck
     def test_issue251_issue252_need_to_collect_in_background(self):
-        # Between greenlet 1.1.2 and the next version, this was still
-        # failing because the leak of the list still exists when we
-        # don't call a greenlet API before exiting the thread. The
-        # proximate cause is that neither of the two greenlets from
-        # the background thread are actually being destroyed, even
-        # though the GC is in fact visiting both objects. It's not
-        # clear where that leak is? For some reason the thread-local
-        # dict holding it isn't being cleaned up.
-        #
-        # The leak, I think, is in the CPYthon internal function that
-        # calls into green_switch(). The argument tuple is still on
-        # the C stack somewhere and can't be reached? That doesn't
-        # make sense, because the tuple should be collectable when
-        # this object goes away.
-        #
-        # Note that this test sometimes spuriously passes on Linux,
-        # for some reason, but I've never seen it pass on macOS.
+        # Up through greenlet 3.0.3, this leaked: the background
+        # thread exited without switching again, so the background
+        # greenlet couldn't be killed in it, and had to be thrown
+        # away along with the reference to the main greenlet
+        # (``getcurrent().parent``) and the argument list on its
+        # stack. Now it's killed in its thread as that exits.
         self._check_issue251(manually_collect_background=False)
 
-    @fails_leakcheck
     def test_issue251_issue252_need_to_collect_in_background_cleanup_disabled(self):
-        self.expect_greenlet_leak = True
         greenlet._greenlet.enable_optional_cleanup(False)
         try:
             self._check_issue251(manually_collect_background=False)
         finally:
             greenlet._greenlet.enable_optional_cleanup(True)
 
-    @fails_leakcheck
     def test_issue251_issue252_explicit_reference_not_collectable(self):
         self._check_issue251(
             manually_collect_background=False,
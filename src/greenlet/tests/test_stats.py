@@ -0,0 +1,131 @@
+"""
+Tests for the counters reported by ``get_stats()``.
+"""
+import sys
+import threading
+import unittest
+
+import greenlet
+from greenlet import greenlet as RawGreenlet
+from . import TestCase
+
+
+def suspend_once():
+    greenlet.getcurrent().parent.switch()
+    return 'done'
+
+
+class StatsTests(TestCase):
+
+    def setUp(self):
+        super(StatsTests, self).setUp()
+        greenlet.reset_stats()
+
+    def test_keys(self):
+        stats = greenlet.get_stats()
+        self.assertEqual(sorted(stats), ['process', 'thread'])
+        self.assertEqual(
+            set(stats['process']) - set(stats['thread']),
+            {'threads', 'stack_copy_bytes', 'stack_copy_bytes_peak'})
+        for value in stats['process'].values():
+            self.assertIsInstance(value, int)
+        self.assertGreaterEqual(stats['process']['threads'], 1)
+
+    def test_switches(self):
+        glet = RawGreenlet(suspend_once)
+        glet.switch()
+        glet.switch()
+        self.assertTrue(glet.dead)
+        stats = greenlet.get_stats()['thread']
+        self.assertEqual(stats['switches'], 4)
+        self.assertEqual(stats['initial_stubs'], 1)
+        self.assertEqual(stats['finished'], 1)
+        self.assertEqual(stats['throws'], 0)
+        self.assertGreater(stats['owner_walks'], 0)
+        self.assertGreater(stats['stack_bytes_saved'], 0)
+        self.assertGreater(stats['stack_reallocs'], 0)
+        # All of it came back.
+        self.assertEqual(stats['stack_bytes_restored'], stats['stack_bytes_saved'])
+
+    def test_throws(self):
+        def run():
+            try:
+                greenlet.getcurrent().parent.switch()
+            except ValueError:
+                return 'caught'
+        glet = RawGreenlet(run)
+        glet.switch()
+        self.assertEqual(glet.throw(ValueError), 'caught')
+        stats = greenlet.get_stats()['thread']
+        self.assertEqual(stats['switches'], 4)
+        self.assertEqual(stats['throws'], 1)
+        self.assertEqual(stats['finished'], 1)
+
+    def test_stack_copy_bytes(self):
+        before = greenlet.get_stats()['process']['stack_copy_bytes']
+        glet = RawGreenlet(suspend_once)
+        glet.switch()
+        suspended = greenlet.get_stats()['process']
+        self.assertGreater(suspended['stack_copy_bytes'], before)
+        self.assertGreaterEqual(suspended['stack_copy_bytes_peak'],
+                                suspended['stack_copy_bytes'])
+        glet.switch()
+        finished = greenlet.get_stats()['process']
+        self.assertEqual(finished['stack_copy_bytes'], before)
+        self.assertEqual(finished['stack_copy_bytes_peak'],
+                         suspended['stack_copy_bytes_peak'])
+
+        greenlet.reset_stats()
+        self.assertEqual(greenlet.get_stats()['process']['stack_copy_bytes_peak'],
+                         before)
+
+    @unittest.skipIf(sys.version_info < (3, 12), "Frames are only exposed on 3.12+")
+    def test_frames_exposed(self):
+        def run():
+            # Entered from C, so its frame has to be rewritten.
+            list(map(lambda _: suspend_once(), [1]))
+        glet = RawGreenlet(run)
+        glet.switch()
+        self.assertGreater(greenlet.get_stats()['thread']['frames_exposed'], 0)
+        glet.switch()
+
+    def test_reset(self):
+        RawGreenlet(suspend_once).switch()
+        self.assertGreater(greenlet.get_stats()['thread']['switches'], 0)
+        greenlet.reset_stats()
+        stats = greenlet.get_stats()
+        for key in stats['thread']:
+            self.assertEqual(stats['thread'][key], 0, key)
+            self.assertEqual(stats['process'][key], 0, key)
+
+    def test_process_includes_other_threads(self):
+        def run():
+            glet = RawGreenlet(suspend_once)
+            glet.switch()
+            glet.switch()
+        t = threading.Thread(target=run)
+        t.start()
+        t.join(10)
+        stats = greenlet.get_stats()
+        self.assertGreaterEqual(
+            stats['process']['switches'] - stats['thread']['switches'], 4)
+        # Still counted once that thread's state is gone.
+        self.wait_for_pending_cleanups()
+        stats = greenlet.get_stats()
+        self.assertGreaterEqual(
+            stats['process']['switches'] - stats['thread']['switches'], 4)
+
+    def test_deleteme_drains(self):
+        glet = RawGreenlet(suspend_once)
+        glet.switch()
+        glets = [glet]
+        del glet
+        # The last reference goes away in another thread, so the
+        # greenlet is queued for us to delete when we next switch.
+        t = threading.Thread(target=glets.clear)
+        t.start()
+        t.join(10)
+        RawGreenlet(lambda: None).switch()
+        stats = greenlet.get_stats()['thread']
+        self.assertGreaterEqual(stats['deleteme_drains'], 1)
+        self.assertGreaterEqual(stats['deleteme_greenlets'], 1)
@@ -0,0 +1,101 @@
+"""
+Tests for the switch latency histograms enabled by
+``enable_switch_histograms()``.
+"""
+import threading
+
+import greenlet
+from greenlet import greenlet as RawGreenlet
+from . import TestCase
+
+PHASES = {'total', 'capture', 'expose', 'save', 'restore', 'trace'}
+
+
+def ping_pong(count):
+    def run():
+        while True:
+            greenlet.getcurrent().parent.switch()
+    glet = RawGreenlet(run)
+    for _ in range(count):
+        glet.switch()
+    glet.throw()
+
+
+def start_histograms():
+    # Tests can be run more than once in the same thread; start
+    # from nothing.
+    greenlet.enable_switch_histograms(False)
+    greenlet.enable_switch_histograms()
+
+
+class SwitchHistogramTests(TestCase):
+
+    def tearDown(self):
+        greenlet.enable_switch_histograms(False)
+        greenlet.settrace(None)
+        super(SwitchHistogramTests, self).tearDown()
+
+    def test_bounds(self):
+        bounds = greenlet.SWITCH_HISTOGRAM_BOUNDS
+        self.assertEqual(bounds[:8], tuple(range(8)))
+        self.assertEqual(list(bounds), sorted(set(bounds)))
+        # No bucket is more than 25% of its lower bound wide.
+        for low, high in zip(bounds[8:], bounds[9:]):
+            self.assertLessEqual(high - low, low // 4)
+        self.assertGreater(bounds[-1], 60 * 10**9)
+
+    def test_disabled_by_default(self):
+        self.assertIsNone(greenlet.get_switch_histograms())
+
+    def test_phases(self):
+        start_histograms()
+        ping_pong(10)
+        histograms = greenlet.get_switch_histograms()
+        self.assertEqual(set(histograms), PHASES)
+        for counts in histograms.values():
+            self.assertEqual(len(counts), len(greenlet.SWITCH_HISTOGRAM_BOUNDS))
+        # 10 switches in each direction (the first one starting the
+        # greenlet), and two more to kill it.
+        self.assertEqual(sum(histograms['total']), 22)
+        self.assertEqual(sum(histograms['capture']), 22)
+        self.assertEqual(sum(histograms['expose']), 22)
+        self.assertEqual(sum(histograms['save']), 22)
+        # Starting a greenlet has nothing to restore.
+        self.assertEqual(sum(histograms['restore']), 21)
+        self.assertEqual(sum(histograms['trace']), 0)
+
+    def test_trace(self):
+        greenlet.enable_switch_histograms()
+        greenlet.settrace(lambda event, args: None)
+        ping_pong(2)
+        histograms = greenlet.get_switch_histograms()
+        self.assertEqual(sum(histograms['trace']), sum(histograms['total']))
+        self.assertEqual(sum(histograms['total']), 6)
+
+    def test_reset(self):
+        start_histograms()
+        ping_pong(1)
+        self.assertEqual(sum(greenlet.get_switch_histograms(reset=True)['total']), 4)
+        self.assertEqual(sum(greenlet.get_switch_histograms()['total']), 0)
+
+    def test_enable_keeps_and_disable_discards(self):
+        start_histograms()
+        ping_pong(1)
+        greenlet.enable_switch_histograms()
+        self.assertEqual(sum(greenlet.get_switch_histograms()['total']), 4)
+        greenlet.enable_switch_histograms(False)
+        self.assertIsNone(greenlet.get_switch_histograms())
+        greenlet.enable_switch_histograms()
+        self.assertEqual(sum(greenlet.get_switch_histograms()['total']), 0)
+
+    def test_per_thread(self):
+        start_histograms()
+        results = []
+        def run():
+            ping_pong(1)
+            results.append(greenlet.get_switch_histograms())
+        t = threading.Thread(target=run)
+        t.start()
+        t.join(10)
+        self.assertEqual(results, [None])
+        self.assertEqual(sum(greenlet.get_switch_histograms()['total']), 0)
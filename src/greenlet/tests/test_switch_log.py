@@ -0,0 +1,127 @@
+"""
+Tests for recording switches with ``start_switch_log()``.
+"""
+import mmap
+import struct
+import threading
+
+import greenlet
+from greenlet import greenlet as RawGreenlet
+from . import TestCase
+
+RECORD_SIZE = struct.calcsize(greenlet.SWITCH_LOG_FORMAT)
+
+
+def records(data):
+    return [
+        (seq, ts, origin, target, stack, greenlet.SWITCH_LOG_EVENTS[event])
+        for seq, ts, origin, target, stack, event
+        in struct.iter_unpack(greenlet.SWITCH_LOG_FORMAT, data)
+    ]
+
+
+def bounce(count):
+    main = greenlet.getcurrent()
+    def run():
+        for _ in range(count):
+            main.switch()
+    glet = RawGreenlet(run)
+    for _ in range(count + 1):
+        glet.switch()
+    return glet
+
+
+class SwitchLogTests(TestCase):
+
+    def tearDown(self):
+        greenlet.stop_switch_log()
+        super(SwitchLogTests, self).tearDown()
+
+    def test_records_events(self):
+        main = greenlet.getcurrent()
+        def throws():
+            try:
+                main.switch()
+            except ValueError:
+                pass
+        thrower = RawGreenlet(throws)
+        thrower.switch()
+        greenlet.start_switch_log(16)
+        glet = bounce(1)
+        thrower.throw(ValueError)
+        log = records(greenlet.drain_switch_log())
+        self.assertEqual(
+            [(origin, target, event) for _, _, origin, target, _, event in log],
+            [(id(main), id(glet), 'start'),
+             (id(glet), id(main), 'switch'),
+             (id(main), id(glet), 'switch'),
+             (id(glet), id(main), 'finish'),
+             (id(main), id(thrower), 'throw'),
+             (id(thrower), id(main), 'finish')])
+        self.assertEqual([r[0] for r in log], list(range(6)))
+        timestamps = [r[1] for r in log]
+        self.assertEqual(timestamps, sorted(timestamps))
+        # Switching between stacks has to copy some of them.
+        self.assertTrue(all(r[4] > 0 for r in log))
+        self.assertEqual(greenlet.drain_switch_log(), b'')
+
+    def test_padding_is_zero(self):
+        greenlet.start_switch_log(16)
+        bounce(3)
+        data = greenlet.drain_switch_log()
+        self.assertEqual(len(data), 8 * RECORD_SIZE)
+        for i in range(0, len(data), RECORD_SIZE):
+            self.assertEqual(data[i + RECORD_SIZE - 4:i + RECORD_SIZE], b'\0' * 4)
+
+    def test_oldest_overwritten(self):
+        greenlet.start_switch_log(3)
+        bounce(5)
+        log = records(greenlet.drain_switch_log())
+        # The start, 5 switches each way and the finish, but we only
+        # kept the last three.
+        self.assertEqual([r[0] for r in log], [9, 10, 11])
+        self.assertEqual(log[-1][-1], 'finish')
+
+    def test_drain_into_buffer(self):
+        greenlet.start_switch_log(16)
+        bounce(1)
+        buf = bytearray(RECORD_SIZE * 3 // 2)
+        self.assertEqual(greenlet.drain_switch_log(buf), 1)
+        self.assertEqual(records(buf[:RECORD_SIZE])[0][-1], 'start')
+
+        sink = mmap.mmap(-1, RECORD_SIZE * 8)
+        try:
+            self.assertEqual(greenlet.drain_switch_log(sink), 3)
+            log = records(sink[:RECORD_SIZE * 3])
+        finally:
+            sink.close()
+        self.assertEqual([r[0] for r in log], [1, 2, 3])
+        self.assertEqual(greenlet.drain_switch_log(bytearray(RECORD_SIZE)), 0)
+        with self.assertRaises(BufferError):
+            greenlet.drain_switch_log(b'read only')
+
+    def test_per_thread(self):
+        greenlet.start_switch_log(16)
+        def other():
+            self.assertEqual(greenlet.drain_switch_log(), b'')
+            bounce(1)
+        t = threading.Thread(target=other)
+        t.start()
+        t.join(10)
+        self.assertEqual(greenlet.drain_switch_log(), b'')
+
+    def test_stop_and_restart(self):
+        greenlet.start_switch_log(16)
+        bounce(1)
+        greenlet.start_switch_log(16)
+        self.assertEqual(greenlet.drain_switch_log(), b'')
+        bounce(1)
+        greenlet.stop_switch_log()
+        self.assertEqual(greenlet.drain_switch_log(), b'')
+        self.assertEqual(greenlet.drain_switch_log(bytearray(RECORD_SIZE)), 0)
+
+    def test_bad_capacity(self):
+        with self.assertRaises(ValueError):
+            greenlet.start_switch_log(0)
+        with self.assertRaises(TypeError):
+            greenlet.start_switch_log('16')
@@ -0,0 +1,264 @@
+"""
+Tests for queueing switches into greenlets from other threads.
+"""
+import os
+import threading
+import unittest
+
+import greenlet
+from greenlet import greenlet as RawGreenlet
+from greenlet import run_pending_switches
+from . import TestCase
+from . import in_child_process
+
+
+def waiter(results):
+    def run():
+        while True:
+            results.append(greenlet.getcurrent().parent.switch())
+    glet = RawGreenlet(run)
+    glet.switch()
+    return glet
+
+
+def in_thread(func, *args):
+    t = threading.Thread(target=func, args=args)
+    t.start()
+    t.join(10)
+
+
+class SwitchThreadsafeTests(TestCase):
+
+    def tearDown(self):
+        greenlet.set_switch_wakeup(None)
+        run_pending_switches()
+        super(SwitchThreadsafeTests, self).tearDown()
+
+    def test_switch_from_other_thread(self):
+        results = []
+        glet = waiter(results)
+        in_thread(glet.switch_threadsafe, 42)
+        # Nothing happens until we ask.
+        self.assertEqual(results, [])
+        self.assertEqual(run_pending_switches(), 1)
+        self.assertEqual(results, [42])
+        self.assertEqual(run_pending_switches(), 0)
+        glet.throw()
+
+    def test_switches_run_in_order(self):
+        results = []
+        glet = waiter(results)
+        def queue():
+            glet.switch_threadsafe(1)
+            glet.switch_threadsafe(2, 3)
+            glet.switch_threadsafe(x=4)
+        in_thread(queue)
+        self.assertEqual(run_pending_switches(), 3)
+        self.assertEqual(results, [1, (2, 3), {'x': 4}])
+        glet.throw()
+
+    def test_throw_from_other_thread(self):
+        seen = []
+        def run():
+            try:
+                greenlet.getcurrent().parent.switch()
+            except ValueError as ex:
+                seen.append(ex)
+                return 'dead'
+        glet = RawGreenlet(run)
+        glet.switch()
+        in_thread(glet.throw_threadsafe, ValueError('boom'))
+        run_pending_switches()
+        self.assertEqual([str(ex) for ex in seen], ['boom'])
+        self.assertTrue(glet.dead)
+
+    def test_throw_arguments_checked_when_queued(self):
+        glet = waiter([])
+        with self.assertRaises(TypeError):
+            glet.throw_threadsafe("abc")
+        self.assertEqual(run_pending_switches(), 0)
+        glet.throw()
+
+    def test_exception_propagates_and_rest_stay_queued(self):
+        results = []
+        def run():
+            greenlet.getcurrent().parent.switch()
+            raise ValueError('from the target')
+        failing = RawGreenlet(run)
+        failing.switch()
+        glet = waiter(results)
+        failing.switch_threadsafe()
+        glet.switch_threadsafe(1)
+        with self.assertRaises(ValueError):
+            run_pending_switches()
+        self.assertEqual(results, [])
+        self.assertEqual(run_pending_switches(), 1)
+        self.assertEqual(results, [1])
+        glet.throw()
+
+    def test_wakeup_called_in_queueing_thread(self):
+        calls = []
+        def wakeup():
+            calls.append(threading.current_thread())
+        self.assertIsNone(greenlet.set_switch_wakeup(wakeup))
+        glet = waiter([])
+        def queue():
+            glet.switch_threadsafe()
+            glet.switch_threadsafe()
+            calls.append('queued')
+        in_thread(queue)
+        # Only the first one found nothing waiting.
+        self.assertEqual(len(calls), 2)
+        self.assertIsNot(calls[0], threading.current_thread())
+        self.assertEqual(calls[1], 'queued')
+
+        self.assertEqual(run_pending_switches(), 2)
+        in_thread(glet.switch_threadsafe)
+        self.assertEqual(len(calls), 3)
+        self.assertIs(greenlet.set_switch_wakeup(None), wakeup)
+        glet.throw()
+
+    def test_wakeup_errors_ignored(self):
+        def wakeup():
+            raise ValueError("ignored")
+        greenlet.set_switch_wakeup(wakeup)
+        results = []
+        glet = waiter(results)
+        glet.switch_threadsafe(1)
+        self.assertEqual(run_pending_switches(), 1)
+        self.assertEqual(results, [1])
+        glet.throw()
+
+    def test_switch_into_exited_thread(self):
+        glets = []
+        in_thread(lambda: glets.append(RawGreenlet(lambda: None)))
+        self.wait_for_pending_cleanups()
+        with self.assertRaises(greenlet.error):
+            glets[0].switch_threadsafe()
+
+    def test_owning_thread_runs_switches(self):
+        results = []
+        queued = threading.Event()
+        ready = threading.Event()
+        def owner():
+            glets.append(waiter(results))
+            ready.set()
+            queued.wait(10)
+            run_pending_switches()
+            glets[0].throw()
+        glets = []
+        t = threading.Thread(target=owner)
+        t.start()
+        ready.wait(10)
+        glets[0].switch_threadsafe('hello')
+        queued.set()
+        t.join(10)
+        self.assertEqual(results, ['hello'])
+
+
+class RunInThreadTests(TestCase):
+
+    def setUp(self):
+        super(RunInThreadTests, self).setUp()
+        self.wakeup = threading.Event()
+        greenlet.set_switch_wakeup(self.wakeup.set)
+
+    def tearDown(self):
+        greenlet.set_switch_wakeup(None)
+        super(RunInThreadTests, self).tearDown()
+
+    def _run(self, *funcs):
+        glets = [RawGreenlet(func) for func in funcs]
+        for glet in glets:
+            glet.switch()
+        while not all(glet.dead for glet in glets):
+            self.assertTrue(self.wakeup.wait(10))
+            self.wakeup.clear()
+            run_pending_switches()
+
+    def test_returns_result_from_other_thread(self):
+        results = []
+        def call():
+            results.append(greenlet.run_in_thread(
+                lambda a, b=None: (threading.get_ident(), a, b),
+                1, b=2))
+        self._run(call)
+        ident, a, b = results[0]
+        self.assertNotEqual(ident, threading.get_ident())
+        self.assertEqual((a, b), (1, 2))
+
+    def test_raises_exception(self):
+        def fail():
+            raise ValueError("from the worker")
+        seen = []
+        def call():
+            try:
+                greenlet.run_in_thread(fail)
+            except ValueError as ex:
+                seen.append(ex)
+        self._run(call)
+        self.assertEqual([str(ex) for ex in seen], ["from the worker"])
+
+    def test_other_greenlets_run_meanwhile(self):
+        results = []
+        release = threading.Event()
+        def blocked():
+            results.append(greenlet.run_in_thread(release.wait, 10))
+        def other():
+            results.append('other')
+            release.set()
+        self._run(blocked, other)
+        self.assertEqual(results, ['other', True])
+
+    def test_many_calls(self):
+        results = []
+        def call(i):
+            return lambda: results.append(greenlet.run_in_thread(lambda: i))
+        self._run(*[call(i) for i in range(50)])
+        self.assertEqual(sorted(results), list(range(50)))
+
+    def test_not_in_main_greenlet(self):
+        with self.assertRaises(greenlet.error):
+            greenlet.run_in_thread(lambda: None)
+
+    def test_not_callable(self):
+        with self.assertRaises(TypeError):
+            greenlet.run_in_thread()
+        with self.assertRaises(TypeError):
+            greenlet.run_in_thread(42)
+
+    @unittest.skipUnless(hasattr(os, 'fork'), "needs fork()")
+    def test_fork_abandons_calls_and_starts_new_workers(self):
+        # Leave an idle worker behind, and have another one busy when
+        # we fork.
+        self._run(lambda: greenlet.run_in_thread(lambda: None))
+        release = threading.Event()
+        outcome = []
+        def blocked():
+            try:
+                outcome.append(greenlet.run_in_thread(release.wait, 10))
+            except RuntimeError as ex:
+                outcome.append(ex)
+        glet = RawGreenlet(blocked)
+        glet.switch()
+
+        def child():
+            while not glet.dead:
+                if not self.wakeup.wait(5):
+                    return 1
+                self.wakeup.clear()
+                run_pending_switches()
+            if not isinstance(outcome[0], RuntimeError):
+                return 2
+            results = []
+            self._run(lambda: results.append(greenlet.run_in_thread(lambda: 42)))
+            return 0 if results == [42] else 3
+
+        status = in_child_process(child)
+        release.set()
+        while not glet.dead:
+            self.assertTrue(self.wakeup.wait(10))
+            self.wakeup.clear()
+            run_pending_switches()
+        self.assertEqual(outcome, [True])
+        self.assertEqual(status, 0)
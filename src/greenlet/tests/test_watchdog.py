@@ -0,0 +1,143 @@
+"""
+Tests for ``start_watchdog()``.
+"""
+import io
+import os
+import sys
+import threading
+import time
+import unittest
+
+import greenlet
+from greenlet import greenlet as RawGreenlet
+from . import TestCase
+from . import in_child_process
+from . import spin
+
+
+class WatchdogTests(TestCase):
+
+    def setUp(self):
+        super(WatchdogTests, self).setUp()
+        self.stalls = []
+
+    def tearDown(self):
+        greenlet.stop_watchdog()
+        super(WatchdogTests, self).tearDown()
+
+    def callback(self, glet, frame, seconds):
+        self.stalls.append((glet, frame.f_code.co_name if frame else None,
+                            seconds, threading.get_ident()))
+
+    def test_reports_stalled_greenlet(self):
+        glet = RawGreenlet(spin)
+        greenlet.start_watchdog(20, self.callback)
+        glet.switch(0.3)
+        greenlet.stop_watchdog()
+        # Once per stall.
+        self.assertEqual(len(self.stalls), 1, self.stalls)
+        stalled, code, seconds, thread = self.stalls[0]
+        self.assertIs(stalled, glet)
+        self.assertEqual(code, 'spin')
+        self.assertGreaterEqual(seconds, 0.02)
+        self.assertNotEqual(thread, threading.get_ident())
+
+    def test_switching_is_not_a_stall(self):
+        main = greenlet.getcurrent()
+        def bounce():
+            while True:
+                spin(0.002)
+                main.switch()
+        glet = RawGreenlet(bounce)
+        greenlet.start_watchdog(100, self.callback)
+        end = time.perf_counter() + 0.3
+        while time.perf_counter() < end:
+            glet.switch()
+        greenlet.stop_watchdog()
+        glet.throw()
+        self.assertEqual(self.stalls, [])
+
+    def test_each_stall_reported(self):
+        main = greenlet.getcurrent()
+        def run():
+            spin(0.2)
+            main.switch()
+            spin(0.2)
+        glet = RawGreenlet(run)
+        greenlet.start_watchdog(20, self.callback)
+        glet.switch()
+        glet.switch()
+        greenlet.stop_watchdog()
+        self.assertEqual([s[0] for s in self.stalls], [glet, glet])
+
+    @unittest.skipUnless(hasattr(os, 'fork'), "needs fork()")
+    def test_forked_child_still_watched(self):
+        greenlet.start_watchdog(20, self.callback)
+        def child():
+            glet = RawGreenlet(spin)
+            glet.switch(0.3)
+            return 0 if [s[0] for s in self.stalls] == [glet] else 1
+        status = in_child_process(child)
+        greenlet.stop_watchdog()
+        self.assertEqual(status, 0)
+
+    def test_stopped(self):
+        greenlet.start_watchdog(20, self.callback)
+        greenlet.stop_watchdog()
+        RawGreenlet(spin).switch(0.2)
+        self.assertEqual(self.stalls, [])
+
+    def test_replaced(self):
+        greenlet.start_watchdog(20, lambda *args: self.stalls.append('first'))
+        greenlet.start_watchdog(20, self.callback)
+        RawGreenlet(spin).switch(0.2)
+        greenlet.stop_watchdog()
+        self.assertEqual(len(self.stalls), 1)
+        self.assertNotEqual(self.stalls[0], 'first')
+
+    def test_exited_thread_not_reported(self):
+        t = threading.Thread(target=greenlet.start_watchdog,
+                             args=(20, self.callback))
+        t.start()
+        t.join(10)
+        time.sleep(0.2)
+        self.assertEqual(self.stalls, [])
+
+    def test_default_prints_stack(self):
+        stderr = io.StringIO()
+        old_stderr = sys.stderr
+        sys.stderr = stderr
+        try:
+            greenlet.start_watchdog(20)
+            RawGreenlet(spin).switch(0.2)
+            greenlet.stop_watchdog()
+        finally:
+            sys.stderr = old_stderr
+        output = stderr.getvalue()
+        self.assertIn("hasn't switched for", output)
+        self.assertIn('in spin', output)
+
+    def test_callback_errors_ignored(self):
+        def callback(*args):
+            self.stalls.append(args)
+            raise ValueError("ignored")
+        stderr = io.StringIO()
+        old_stderr = sys.stderr
+        sys.stderr = stderr
+        try:
+            greenlet.start_watchdog(20, callback)
+            RawGreenlet(spin).switch(0.2)
+            greenlet.stop_watchdog()
+        finally:
+            sys.stderr = old_stderr
+        self.assertEqual(len(self.stalls), 1)
+        self.assertIn('ValueError: ignored', stderr.getvalue())
+
+    def test_bad_arguments(self):
+        with self.assertRaises(ValueError):
+            greenlet.start_watchdog(0)
+        for threshold in (float('inf'), float('-inf'), float('nan'), 1e13, 2.0 ** 63 / 1e6):
+            with self.assertRaises(ValueError):
+                greenlet.start_watchdog(threshold)
+        with self.assertRaises(TypeError):
+            greenlet.start_watchdog(10, 42)